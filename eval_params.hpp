@@ -0,0 +1,122 @@
+#pragma once
+
+// Evaluation weights of NoisyBoy as {middlegame, endgame} pairs, from
+// white's point of view. Piece-square tables start at a1.
+//
+// Written by the tuner ("make tune"), which overwrites any hand edits.
+
+#include <array>
+
+namespace eval_params {
+
+struct Weight {
+    int mg;
+    int eg;
+};
+
+// Indexed by PieceType
+constexpr std::array<Weight, 5> MATERIAL{{
+    {100, 120}, {300, 300}, {300, 300}, {500, 500}, {900, 900}
+}};
+
+// Indexed by [PieceType][square]
+constexpr std::array<std::array<Weight, 64>, 6> PIECE_SQUARE{{
+    // Pawn
+    {{
+        {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0},
+        {5, 0}, {10, 0}, {10, 0}, {-40, 0}, {-40, 0}, {10, 0}, {10, 0}, {5, 0},
+        {5, 5}, {-5, 5}, {-10, 5}, {0, 5}, {0, 5}, {-10, 5}, {-5, 5}, {5, 5},
+        {0, 10}, {0, 10}, {0, 10}, {50, 10}, {50, 10}, {0, 10}, {0, 10}, {0, 10},
+        {5, 25}, {5, 25}, {10, 25}, {25, 25}, {25, 25}, {10, 25}, {5, 25}, {5, 25},
+        {10, 50}, {10, 50}, {20, 50}, {30, 50}, {30, 50}, {20, 50}, {10, 50}, {10, 50},
+        {50, 90}, {50, 90}, {50, 90}, {50, 90}, {50, 90}, {50, 90}, {50, 90}, {50, 90},
+        {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}
+    }},
+    // Knight
+    {{
+        {-50, -50}, {-40, -40}, {-30, -30}, {-30, -30}, {-30, -30}, {-30, -30}, {-40, -40}, {-50, -50},
+        {-40, -40}, {-20, -20}, {0, 0}, {5, 5}, {5, 5}, {0, 0}, {-20, -20}, {-40, -40},
+        {-30, -30}, {5, 5}, {10, 10}, {15, 15}, {15, 15}, {10, 10}, {5, 5}, {-30, -30},
+        {-30, -30}, {0, 0}, {15, 15}, {20, 20}, {20, 20}, {15, 15}, {0, 0}, {-30, -30},
+        {-30, -30}, {5, 5}, {15, 15}, {20, 20}, {20, 20}, {15, 15}, {5, 5}, {-30, -30},
+        {-30, -30}, {0, 0}, {10, 10}, {15, 15}, {15, 15}, {10, 10}, {0, 0}, {-30, -30},
+        {-40, -40}, {-20, -20}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {-20, -20}, {-40, -40},
+        {-50, -50}, {-40, -40}, {-30, -30}, {-30, -30}, {-30, -30}, {-30, -30}, {-40, -40}, {-50, -50}
+    }},
+    // Bishop
+    {{
+        {-20, -20}, {-10, -10}, {-40, -40}, {-10, -10}, {-10, -10}, {-40, -40}, {-10, -10}, {-20, -20},
+        {-10, -10}, {5, 5}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {5, 5}, {-10, -10},
+        {-10, -10}, {10, 10}, {10, 10}, {10, 10}, {10, 10}, {10, 10}, {10, 10}, {-10, -10},
+        {-10, -10}, {0, 0}, {20, 20}, {10, 10}, {10, 10}, {20, 20}, {0, 0}, {-10, -10},
+        {-10, -10}, {5, 5}, {5, 5}, {10, 10}, {10, 10}, {5, 5}, {5, 5}, {-10, -10},
+        {-10, -10}, {0, 0}, {5, 5}, {10, 10}, {10, 10}, {5, 5}, {0, 0}, {-10, -10},
+        {-10, -10}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {-10, -10},
+        {-20, -20}, {-10, -10}, {-40, -40}, {-10, -10}, {-10, -10}, {-40, -40}, {-10, -10}, {-20, -20}
+    }},
+    // Rook
+    {{
+        {0, 0}, {0, 0}, {0, 0}, {5, 5}, {5, 5}, {0, 0}, {0, 0}, {0, 0},
+        {-5, -5}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {-5, -5},
+        {-5, -5}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {-5, -5},
+        {-5, -5}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {-5, -5},
+        {-5, -5}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {-5, -5},
+        {-5, -5}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {-5, -5},
+        {5, 5}, {10, 10}, {10, 10}, {10, 10}, {10, 10}, {10, 10}, {10, 10}, {5, 5},
+        {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}
+    }},
+    // Queen
+    {{
+        {-20, -20}, {-10, -10}, {-10, -10}, {-5, -5}, {-5, -5}, {-10, -10}, {-10, -10}, {-20, -20},
+        {-10, -10}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {-10, -10},
+        {-10, -10}, {5, 5}, {5, 5}, {5, 5}, {5, 5}, {5, 5}, {0, 0}, {-10, -10},
+        {0, 0}, {0, 0}, {5, 5}, {5, 5}, {5, 5}, {5, 5}, {0, 0}, {-5, -5},
+        {-5, -5}, {0, 0}, {5, 5}, {5, 5}, {5, 5}, {5, 5}, {0, 0}, {-5, -5},
+        {-10, -10}, {0, 0}, {5, 5}, {5, 5}, {5, 5}, {5, 5}, {0, 0}, {-10, -10},
+        {-10, -10}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {-10, -10},
+        {-20, -20}, {-10, -10}, {-10, -10}, {-5, -5}, {-5, -5}, {-10, -10}, {-10, -10}, {-20, -20}
+    }},
+    // King
+    {{
+        {20, -50}, {30, -30}, {10, -30}, {0, -30}, {0, -30}, {10, -30}, {30, -30}, {20, -50},
+        {20, -30}, {20, -30}, {-10, 0}, {-10, 0}, {-10, 0}, {-10, 0}, {20, -30}, {20, -30},
+        {-10, -30}, {-20, -10}, {-20, 20}, {-20, 30}, {-20, 30}, {-20, 20}, {-20, -10}, {-10, -30},
+        {-20, -30}, {-30, -10}, {-30, 30}, {-40, 40}, {-40, 40}, {-30, 30}, {-30, -10}, {-20, -30},
+        {-30, -30}, {-40, -10}, {-40, 30}, {-50, 40}, {-50, 40}, {-40, 30}, {-40, -10}, {-30, -30},
+        {-30, -30}, {-40, -10}, {-40, 20}, {-50, 30}, {-50, 30}, {-40, 20}, {-40, -10}, {-30, -30},
+        {-30, -30}, {-40, -20}, {-40, -10}, {-50, 0}, {-50, 0}, {-40, -10}, {-40, -20}, {-30, -30},
+        {-30, -50}, {-40, -40}, {-40, -30}, {-50, -20}, {-50, -20}, {-40, -30}, {-40, -40}, {-30, -50}
+    }}
+}};
+
+// Pawn structure
+constexpr Weight DOUBLED_PAWN{-10, -20};
+constexpr Weight ISOLATED_PAWN{-10, -15};
+constexpr Weight BACKWARD_PAWN{-8, -10};
+
+// Passed pawns by relative rank
+constexpr std::array<Weight, 8> PASSED_PAWN{{
+    {0, 0}, {0, 5}, {5, 10}, {10, 20}, {20, 35}, {35, 60}, {60, 90}, {0, 0}
+}};
+
+// Material imbalance, the adjustments are per own pawn above five
+constexpr Weight BISHOP_PAIR{30, 50};
+constexpr Weight KNIGHT_PAWN_ADJUST{4, 4};
+constexpr Weight ROOK_PAWN_ADJUST{-8, -8};
+
+// Per reachable square, indexed by PieceType
+constexpr std::array<Weight, 6> MOBILITY{{
+    {0, 0}, {4, 4}, {5, 5}, {2, 4}, {1, 2}, {0, 0}
+}};
+
+// Per piece attacking the enemy king zone, indexed by PieceType
+constexpr std::array<Weight, 6> KING_ATTACK_WEIGHT{{
+    {0, 0}, {20, 0}, {20, 0}, {40, 0}, {80, 0}, {0, 0}
+}};
+
+// Threats
+constexpr Weight THREAT_BY_PAWN{40, 30};
+constexpr Weight THREAT_BY_MINOR{25, 25};
+constexpr Weight HANGING_PIECE{20, 15};
+
+}  // namespace eval_params
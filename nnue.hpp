@@ -0,0 +1,290 @@
+#pragma once
+
+// NNUE evaluation for NoisyBoy.
+//
+// Network: 768 inputs (colour x piece type x square, seen from each side)
+// -> HIDDEN int16 accumulator per perspective -> clipped ReLU [0, QA]
+// -> one output. The side to move's accumulator is weighted by the first
+// output row, the other side's by the second.
+//
+// File format (little endian):
+//   uint32 magic "NBNN", uint32 version, uint32 hidden size
+//   int16  feature weights [768][HIDDEN]
+//   int16  feature biases  [HIDDEN]
+//   int8   output weights  [2][HIDDEN]
+//   int32  output bias, int32 output scale
+// The evaluation in centipawns is (output sum + bias) / scale.
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define NNUE_X86 1
+#else
+#define NNUE_X86 0
+#endif
+
+namespace nnue {
+
+constexpr int FEATURES = 768;
+constexpr int HIDDEN = 32;
+constexpr int QA = 255;
+constexpr uint32_t MAGIC = 0x4e4e424e;
+constexpr uint32_t VERSION = 1;
+
+struct Network {
+    alignas(32) std::array<std::array<int16_t, HIDDEN>, FEATURES> feature_weights;
+    alignas(32) std::array<int16_t, HIDDEN> feature_bias;
+    // Widened from int8 on load so the output kernels can use madd
+    alignas(32) std::array<std::array<int16_t, HIDDEN>, 2> output_weights;
+    int32_t output_bias;
+    int32_t output_scale;
+};
+
+// Hidden layer inputs of both perspectives, indexed by colour
+struct Accumulator {
+    alignas(32) std::array<std::array<int16_t, HIDDEN>, 2> values;
+};
+
+// piece is the library's piece index (WHITEPAWN = 0 ... BLACKKING = 11).
+// Black sees the board flipped, with its own pieces as the first six.
+inline int feature_index(int piece, int square, int perspective) {
+    int color = piece / 6;
+    int type = piece % 6;
+    if (perspective == 1) {
+        color ^= 1;
+        square ^= 56;
+    }
+    return (color * 6 + type) * 64 + square;
+}
+
+// Kernels
+
+inline void add_row_scalar(int16_t *acc, const int16_t *row) {
+    for (int i = 0; i < HIDDEN; i++) {
+        acc[i] += row[i];
+    }
+}
+
+inline void sub_row_scalar(int16_t *acc, const int16_t *row) {
+    for (int i = 0; i < HIDDEN; i++) {
+        acc[i] -= row[i];
+    }
+}
+
+inline int32_t output_scalar(const int16_t *acc, const int16_t *weights) {
+    int32_t sum = 0;
+    for (int i = 0; i < HIDDEN; i++) {
+        int32_t value = acc[i] < 0 ? 0 : acc[i] > QA ? QA : acc[i];
+        sum += value * weights[i];
+    }
+    return sum;
+}
+
+#if NNUE_X86
+
+__attribute__((target("sse4.1")))
+inline void add_row_sse41(int16_t *acc, const int16_t *row) {
+    for (int i = 0; i < HIDDEN; i += 8) {
+        __m128i a = _mm_load_si128(reinterpret_cast<const __m128i *>(acc + i));
+        __m128i r = _mm_load_si128(reinterpret_cast<const __m128i *>(row + i));
+        _mm_store_si128(reinterpret_cast<__m128i *>(acc + i), _mm_add_epi16(a, r));
+    }
+}
+
+__attribute__((target("sse4.1")))
+inline void sub_row_sse41(int16_t *acc, const int16_t *row) {
+    for (int i = 0; i < HIDDEN; i += 8) {
+        __m128i a = _mm_load_si128(reinterpret_cast<const __m128i *>(acc + i));
+        __m128i r = _mm_load_si128(reinterpret_cast<const __m128i *>(row + i));
+        _mm_store_si128(reinterpret_cast<__m128i *>(acc + i), _mm_sub_epi16(a, r));
+    }
+}
+
+__attribute__((target("sse4.1")))
+inline int32_t output_sse41(const int16_t *acc, const int16_t *weights) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i qa = _mm_set1_epi16(QA);
+    __m128i sum = _mm_setzero_si128();
+    for (int i = 0; i < HIDDEN; i += 8) {
+        __m128i a = _mm_load_si128(reinterpret_cast<const __m128i *>(acc + i));
+        __m128i w = _mm_load_si128(reinterpret_cast<const __m128i *>(weights + i));
+        a = _mm_min_epi16(_mm_max_epi16(a, zero), qa);
+        sum = _mm_add_epi32(sum, _mm_madd_epi16(a, w));
+    }
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4e));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xb1));
+    return _mm_cvtsi128_si32(sum);
+}
+
+__attribute__((target("avx2")))
+inline void add_row_avx2(int16_t *acc, const int16_t *row) {
+    for (int i = 0; i < HIDDEN; i += 16) {
+        __m256i a = _mm256_load_si256(reinterpret_cast<const __m256i *>(acc + i));
+        __m256i r = _mm256_load_si256(reinterpret_cast<const __m256i *>(row + i));
+        _mm256_store_si256(reinterpret_cast<__m256i *>(acc + i), _mm256_add_epi16(a, r));
+    }
+}
+
+__attribute__((target("avx2")))
+inline void sub_row_avx2(int16_t *acc, const int16_t *row) {
+    for (int i = 0; i < HIDDEN; i += 16) {
+        __m256i a = _mm256_load_si256(reinterpret_cast<const __m256i *>(acc + i));
+        __m256i r = _mm256_load_si256(reinterpret_cast<const __m256i *>(row + i));
+        _mm256_store_si256(reinterpret_cast<__m256i *>(acc + i), _mm256_sub_epi16(a, r));
+    }
+}
+
+__attribute__((target("avx2")))
+inline int32_t output_avx2(const int16_t *acc, const int16_t *weights) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i qa = _mm256_set1_epi16(QA);
+    __m256i sum = _mm256_setzero_si256();
+    for (int i = 0; i < HIDDEN; i += 16) {
+        __m256i a = _mm256_load_si256(reinterpret_cast<const __m256i *>(acc + i));
+        __m256i w = _mm256_load_si256(reinterpret_cast<const __m256i *>(weights + i));
+        a = _mm256_min_epi16(_mm256_max_epi16(a, zero), qa);
+        sum = _mm256_add_epi32(sum, _mm256_madd_epi16(a, w));
+    }
+    __m128i half = _mm_add_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+    half = _mm_add_epi32(half, _mm_shuffle_epi32(half, 0x4e));
+    half = _mm_add_epi32(half, _mm_shuffle_epi32(half, 0xb1));
+    return _mm_cvtsi128_si32(half);
+}
+
+#endif
+
+static_assert(HIDDEN % 16 == 0, "the SIMD kernels process 16 neurons at a time");
+
+struct Kernels {
+    const char *name;
+    void (*add_row)(int16_t *, const int16_t *);
+    void (*sub_row)(int16_t *, const int16_t *);
+    int32_t (*output)(const int16_t *, const int16_t *);
+};
+
+// Picks the widest instruction set the CPU supports, unless one is forced
+// by name ("avx2", "sse41" or "scalar")
+inline Kernels select_kernels(const std::string &force = "") {
+#if NNUE_X86
+    if (force == "avx2" || (force.empty() && __builtin_cpu_supports("avx2"))) {
+        return {"avx2", add_row_avx2, sub_row_avx2, output_avx2};
+    }
+    if (force == "sse41" || (force.empty() && __builtin_cpu_supports("sse4.1"))) {
+        return {"sse41", add_row_sse41, sub_row_sse41, output_sse41};
+    }
+#endif
+    return {"scalar", add_row_scalar, sub_row_scalar, output_scalar};
+}
+
+inline Kernels kernels = select_kernels();
+
+// Accumulator maintenance
+
+inline void reset(const Network &net, Accumulator &acc) {
+    acc.values[0] = net.feature_bias;
+    acc.values[1] = net.feature_bias;
+}
+
+inline void add_feature(const Network &net, Accumulator &acc, int piece, int square) {
+    kernels.add_row(acc.values[0].data(), net.feature_weights[feature_index(piece, square, 0)].data());
+    kernels.add_row(acc.values[1].data(), net.feature_weights[feature_index(piece, square, 1)].data());
+}
+
+inline void remove_feature(const Network &net, Accumulator &acc, int piece, int square) {
+    kernels.sub_row(acc.values[0].data(), net.feature_weights[feature_index(piece, square, 0)].data());
+    kernels.sub_row(acc.values[1].data(), net.feature_weights[feature_index(piece, square, 1)].data());
+}
+
+// Score in centipawns from the point of view of side_to_move (0 = white)
+inline int evaluate(const Network &net, const Accumulator &acc, int side_to_move) {
+    int32_t sum = kernels.output(acc.values[side_to_move].data(), net.output_weights[0].data())
+                + kernels.output(acc.values[side_to_move ^ 1].data(), net.output_weights[1].data());
+    return (sum + net.output_bias) / net.output_scale;
+}
+
+// Loading and saving
+
+namespace detail {
+
+template <typename T>
+bool read(std::istream &in, T *data, size_t count = 1) {
+    return static_cast<bool>(in.read(reinterpret_cast<char *>(data), sizeof(T) * count));
+}
+
+template <typename T>
+void write(std::ostream &out, const T *data, size_t count = 1) {
+    out.write(reinterpret_cast<const char *>(data), sizeof(T) * count);
+}
+
+}  // namespace detail
+
+// Returns nullptr and sets error if the file is missing or malformed
+inline std::unique_ptr<Network> load(const std::string &path, std::string &error) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        error = "cannot open " + path;
+        return nullptr;
+    }
+
+    uint32_t header[3];
+    if (!detail::read(in, header, 3) || header[0] != MAGIC || header[1] != VERSION) {
+        error = path + " is not a NoisyBoy network";
+        return nullptr;
+    }
+    if (header[2] != HIDDEN) {
+        error = path + " has " + std::to_string(header[2]) + " hidden neurons, expected " + std::to_string(HIDDEN);
+        return nullptr;
+    }
+
+    auto net = std::make_unique<Network>();
+    std::array<std::array<int8_t, HIDDEN>, 2> output_weights;
+    bool ok = detail::read(in, net->feature_weights.data()->data(), FEATURES * HIDDEN)
+           && detail::read(in, net->feature_bias.data(), HIDDEN)
+           && detail::read(in, output_weights.data()->data(), 2 * HIDDEN)
+           && detail::read(in, &net->output_bias)
+           && detail::read(in, &net->output_scale);
+    if (!ok || in.peek() != std::ifstream::traits_type::eof() || net->output_scale <= 0) {
+        error = path + " is truncated or corrupt";
+        return nullptr;
+    }
+
+    for (int side = 0; side < 2; side++) {
+        for (int i = 0; i < HIDDEN; i++) {
+            net->output_weights[side][i] = output_weights[side][i];
+        }
+    }
+    return net;
+}
+
+// Output weights outside the int8 range are clamped
+inline bool save(const Network &net, const std::string &path) {
+    std::ofstream out(path, std::ios::binary);
+    if (!out) {
+        return false;
+    }
+
+    uint32_t header[3] = {MAGIC, VERSION, HIDDEN};
+    std::array<std::array<int8_t, HIDDEN>, 2> output_weights;
+    for (int side = 0; side < 2; side++) {
+        for (int i = 0; i < HIDDEN; i++) {
+            int16_t w = net.output_weights[side][i];
+            output_weights[side][i] = static_cast<int8_t>(w < -128 ? -128 : w > 127 ? 127 : w);
+        }
+    }
+
+    detail::write(out, header, 3);
+    detail::write(out, net.feature_weights.data()->data(), FEATURES * HIDDEN);
+    detail::write(out, net.feature_bias.data(), HIDDEN);
+    detail::write(out, output_weights.data()->data(), 2 * HIDDEN);
+    detail::write(out, &net.output_bias);
+    detail::write(out, &net.output_scale);
+    return static_cast<bool>(out);
+}
+
+}  // namespace nnue
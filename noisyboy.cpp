@@ -1,402 +1,3123 @@
 #include <iostream>
 #include <chess.hpp>
+#include "nnue.hpp"
+#include "eval_params.hpp"
+#include "tablebase.hpp"
+#include "tbgen.hpp"
 #include <map>
 #include <vector>
 #include <unordered_map>
 #include <chrono>
 #include <array>
 #include <string>
+#include <atomic>
+#include <algorithm>
+#include <memory>
+#include <cstdint>
+#include <thread>
+#include <mutex>
+#include <sstream>
+#include <cmath>
+#include <fstream>
+#include <cctype>
+#include <limits>
 
 using namespace chess;
-const int MAX_DEPTH = 20;
+const int MAX_DEPTH = 64;
+const int MAX_PLY = 128;
 const int MATE_VALUE = 10000;
+const int MATE_BOUND = MATE_VALUE - 1000;
+// Tablebase wins are TB_WIN - ply, below every mate and above every evaluation
+const int TB_WIN = MATE_BOUND - 1;
+const int TB_BOUND = TB_WIN - MAX_PLY;
+// Largest static evaluation, so no evaluation reads as a tablebase or mate score
+const int EVAL_MAX = TB_BOUND - 1;
+const int HISTORY_MAX = 8192;
+
+// Nodes searched between two looks at the clock and the stop flag. Reading
+// the clock is a vDSO call, far too expensive to do at every node.
+#ifndef TIME_CHECK_INTERVAL
+#define TIME_CHECK_INTERVAL 1024
+#endif
+
+// Middlegame and endgame halves of an evaluation term packed into one int,
+// so that both are summed with a single addition. The endgame half lives in
+// the upper 16 bits, the lower half carries its sign into it.
+using Score = int32_t;
+
+constexpr Score makeScore(int mg, int eg) {
+    return static_cast<Score>(static_cast<uint32_t>(eg) << 16) + mg;
+}
+
+constexpr int mgScore(Score score) {
+    return static_cast<int16_t>(static_cast<uint16_t>(static_cast<uint32_t>(score)));
+}
+
+constexpr int egScore(Score score) {
+    return static_cast<int16_t>(static_cast<uint16_t>((static_cast<uint32_t>(score) + 0x8000) >> 16));
+}
+
+// The tunable evaluation weights live in eval_params.hpp
+constexpr Score toScore(eval_params::Weight weight) {
+    return makeScore(weight.mg, weight.eg);
+}
+
+// Build with TUNE=1 for the tune command, see tune(). The evaluation then
+// records how often each weight of eval_params contributes to it.
+#ifndef TUNE
+#define TUNE 0
+#endif
+
+#if TUNE
+// Index of every weight of eval_params in a flat parameter vector
+namespace term {
+enum : int {
+    MATERIAL = 0,
+    PIECE_SQUARE = MATERIAL + 5,
+    DOUBLED_PAWN = PIECE_SQUARE + 6 * 64,
+    ISOLATED_PAWN,
+    BACKWARD_PAWN,
+    PASSED_PAWN,
+    BISHOP_PAIR = PASSED_PAWN + 8,
+    KNIGHT_PAWN_ADJUST,
+    ROOK_PAWN_ADJUST,
+    MOBILITY,
+    KING_ATTACK_WEIGHT = MOBILITY + 6,
+    THREAT_BY_PAWN = KING_ATTACK_WEIGHT + 6,
+    THREAT_BY_MINOR,
+    HANGING_PIECE,
+    COUNT
+};
+}
+
+// Coefficient of every weight, white's minus black's
+struct EvalTrace {
+    std::array<double, term::COUNT> coeffs{};
+};
+
+thread_local EvalTrace *eval_trace = nullptr;
+
+#define TRACE(color, index, value)                                                            \
+    do {                                                                                      \
+        if (eval_trace) {                                                                     \
+            eval_trace->coeffs[index] += (color) == Color::WHITE ? (value) : -(value);        \
+        }                                                                                     \
+    } while (0)
+#else
+#define TRACE(color, index, value) do {} while (0)
+#endif
+
+struct PieceInfo {
+    chess::PieceType type;
+    int materialValue;
+};
+
+// Limits of a single search as given by the "go" command. Without any clock
+// time (wtime/btime and increments all zero) or movetime the search is only
+// bounded by depth, nodes and mate.
+struct SearchLimits {
+    int wtime = 0;
+    int btime = 0;
+    int winc = 0;
+    int binc = 0;
+    int movestogo = 0;
+    int movetime = 0;
+    int depth = MAX_DEPTH - 1;
+    long long nodes = 0;
+    int mate = 0;
+    bool infinite = false;
+    bool ponder = false;
+};
+
+// Per-ply state of the search, indexed by ply from the root
+struct SearchStack {
+    // Triangular PV: the principal variation found below this ply
+    std::array<Move, MAX_PLY> pv{};
+    int pv_length = 0;
+    Move current_move = Move::NO_MOVE;
+    // Move skipped by the node's move loop, for searches that exclude one
+    Move excluded_move = Move::NO_MOVE;
+    std::array<Move, 2> killers{};
+    int static_eval = 0;
+};
+
+struct EvalTables;
+
+struct SearchInfo {
+    std::array<SearchStack, MAX_PLY> stack{};
+    long long nodes;
+    long long qnodes = 0;
+    std::chrono::time_point<std::chrono::high_resolution_clock> max_time;
+    std::chrono::time_point<std::chrono::high_resolution_clock> start;
+    // This thread's share of the "go nodes" budget, zero when unlimited
+    long long max_nodes = 0;
+    // Cached result of the last stop check, see poll_stop()
+    bool stopped = false;
+    int polls_left = TIME_CHECK_INTERVAL;
+    // Highest ply reached, reported as seldepth
+    int seldepth = 0;
+    // Butterfly history of quiet moves, indexed by [color][from][to]
+    std::array<std::array<std::array<int16_t, 64>, 64>, 2> history{};
+    // This thread's entry of eval_tables
+    EvalTables *eval_tables = nullptr;
+    long long tbhits = 0;
+    // Moves searched at the root, all legal moves when empty
+    Movelist root_moves;
+};
+
+// Nominal piece values for exchanges (SEE, delta pruning) and material
+// rules. The evaluation takes its material weights from eval_params.
+static constexpr std::array<PieceInfo, 5> pieceInfos{{
+    { chess::PieceType::PAWN,   100 },
+    { chess::PieceType::KNIGHT, 300 },
+    { chess::PieceType::BISHOP, 300 },
+    { chess::PieceType::ROOK,   500 },
+    { chess::PieceType::QUEEN,  900 }
+}};
+
+inline int pieceValue(PieceType type) {
+    return type == PieceType::KING ? 0 : pieceInfos[type].materialValue;
+}
+
+// Material plus piece-square bonus of every piece on every square, packed
+// as middlegame/endgame Score and indexed by [chess::Piece][square]
+constexpr std::array<std::array<Score, 64>, 12> pieceSquareScores = [] {
+    std::array<std::array<Score, 64>, 12> scores{};
+    for (int pt = 0; pt < 6; ++pt) {
+        Score material = pt < 5 ? toScore(eval_params::MATERIAL[pt]) : 0;
+        for (int sq = 0; sq < 64; ++sq) {
+            scores[pt][sq] = material + toScore(eval_params::PIECE_SQUARE[pt][sq]);
+            // Mirrored for black
+            scores[pt + 6][sq ^ 56] = scores[pt][sq];
+        }
+    }
+    return scores;
+}();
+
+// Game phase: 24 with all minor and major pieces on the board, 0 with none
+constexpr std::array<int, 12> piecePhase{{0, 1, 1, 2, 4, 0, 0, 1, 1, 2, 4, 0}};
+const int PHASE_MAX = 24;
+
+// Endgame scale factors: the endgame half of the score is multiplied by
+// scale / SCALE_NORMAL
+const int SCALE_NORMAL = 64;
+
+// Blends the two halves of score by phase
+inline int taper(Score score, int phase, int scale = SCALE_NORMAL) {
+    phase = std::min(phase, PHASE_MAX);
+    return (mgScore(score) * phase + egScore(score) * scale / SCALE_NORMAL * (PHASE_MAX - phase)) / PHASE_MAX;
+}
+
+// Build with INCREMENTAL_EVAL=0 to recompute the material and piece-square
+// sums, the pawn terms and the material entry from the bitboards on every
+// score() call instead.
+#ifndef INCREMENTAL_EVAL
+#define INCREMENTAL_EVAL 1
+#endif
+
+// NNUE evaluation, see nnue.hpp. While use_nnue is set every NoisyBoard
+// keeps an accumulator for nnue_network up to date.
+std::unique_ptr<nnue::Network> nnue_network;
+bool use_nnue = false;
+std::string eval_file = "nets/reference.nnue";
+
+// Zobrist keys of the pawns, indexed by [chess::Piece][square] and zero for
+// the other pieces. Filled from the library's keys by init_pawn_keys().
+std::array<std::array<uint64_t, 64>, 12> pawn_keys{};
+
+// Material key of the n-th piece of each kind, indexed by [chess::Piece][n].
+// The material key of a position is the XOR of the keys of its pieces.
+constexpr std::array<std::array<uint64_t, 16>, 12> material_keys = [] {
+    std::array<std::array<uint64_t, 16>, 12> keys{};
+    uint64_t seed = 0x9e3779b97f4a7c15ULL;
+    for (auto &piece : keys) {
+        for (auto &key : piece) {
+            // splitmix64
+            uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+            key = z ^ (z >> 31);
+        }
+    }
+    return keys;
+}();
+
+// Board used by the engine. With INCREMENTAL_EVAL the packed material and
+// piece-square sums of each side are kept up to date
+// through the placePiece/removePiece hooks. unmakeMove replays the inverse hook calls,
+// so the sums are restored without having to save them per move. The
+// pawn key (the XOR of pawn_keys of every pawn), the piece counts and the
+// material key are kept the same way.
+class NoisyBoard : public Board {
+public:
+    explicit NoisyBoard(std::string_view fen = constants::STARTPOS) : Board(fen) {
+        // The Board constructor bypasses the virtual hooks
+        setFen(fen);
+    }
+
+    void setFen(std::string_view fen) override {
+        psqt_ = {};
+        pawn_key_ = 0;
+        material_key_ = 0;
+        piece_counts_ = {};
+        null_moves_.clear();
+        if (use_nnue) {
+            nnue::reset(*nnue_network, accumulator_);
+        }
+        Board::setFen(fen);
+    }
+
+    const nnue::Accumulator &accumulator() const { return accumulator_; }
+
+    // Rebuilds the accumulator from the pieces on the board, needed after
+    // loading another network or switching NNUE on
+    void refresh_accumulator() {
+        if (!use_nnue) {
+            return;
+        }
+        nnue::reset(*nnue_network, accumulator_);
+        for (Bitboard pieces = occ(); !pieces.empty();) {
+            Square sq = pieces.pop();
+            nnue::add_feature(*nnue_network, accumulator_, at(sq), sq.index());
+        }
+    }
+
+    // Hide Board's versions to remember where null moves were made, since
+    // no repetition can reach across one
+    void makeNullMove() {
+        null_moves_.push_back(static_cast<int>(prev_states_.size()));
+        Board::makeNullMove();
+    }
+
+    void unmakeNullMove() {
+        Board::unmakeNullMove();
+        null_moves_.pop_back();
+    }
+
+    // Repetition as the search sees it: a position repeated after the root
+    // (within ply plies) is a draw at once, an older one must occur twice
+    bool is_repetition(int ply) const {
+        int end = repetition_window();
+        int size = static_cast<int>(prev_states_.size());
+        int count = 0;
+
+        for (int i = 4; i <= end; i += 2) {
+            if (prev_states_[size - i].hash == hash() && (i <= ply || ++count == 2)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Upcoming repetition: true if the side to move has a reversible move
+    // that brings back a position reached after the root. Cycles are found
+    // through the cuckoo tables of reversible move keys, see init_cuckoo().
+    bool has_game_cycle(int ply) const;
+
+#if INCREMENTAL_EVAL
+    Score psqtScore(Color color) const { return psqt_[color]; }
+#endif
+    uint64_t pawnKey() const { return pawn_key_; }
+    uint64_t materialKey() const { return material_key_; }
+    // Indexed by chess::Piece
+    const std::array<uint8_t, 12> &pieceCounts() const { return piece_counts_; }
+
+protected:
+    void placePiece(Piece piece, Square sq) override {
+        Board::placePiece(piece, sq);
+#if INCREMENTAL_EVAL
+        psqt_[piece.color()] += pieceSquareScores[piece][sq.index()];
+#endif
+        pawn_key_ ^= pawn_keys[piece][sq.index()];
+        material_key_ ^= material_keys[piece][piece_counts_[piece]++];
+        if (use_nnue) {
+            nnue::add_feature(*nnue_network, accumulator_, piece, sq.index());
+        }
+    }
+
+    void removePiece(Piece piece, Square sq) override {
+        Board::removePiece(piece, sq);
+#if INCREMENTAL_EVAL
+        psqt_[piece.color()] -= pieceSquareScores[piece][sq.index()];
+#endif
+        pawn_key_ ^= pawn_keys[piece][sq.index()];
+        material_key_ ^= material_keys[piece][--piece_counts_[piece]];
+        if (use_nnue) {
+            nnue::remove_feature(*nnue_network, accumulator_, piece, sq.index());
+        }
+    }
+
+private:
+    // Plies that can take part in a repetition: none before the last
+    // irreversible move or null move
+    int repetition_window() const {
+        int plies = static_cast<int>(halfMoveClock());
+        if (!null_moves_.empty()) {
+            plies = std::min(plies, static_cast<int>(prev_states_.size()) - null_moves_.back() - 1);
+        }
+        return std::min(plies, static_cast<int>(prev_states_.size()));
+    }
+
+    std::array<Score, 2> psqt_{};
+    uint64_t pawn_key_ = 0;
+    uint64_t material_key_ = 0;
+    std::array<uint8_t, 12> piece_counts_{};
+    nnue::Accumulator accumulator_{};
+    // prev_states_ size at each null move on the current line
+    std::vector<int> null_moves_;
+};
+
+// Cuckoo hash of the Zobrist key difference of every reversible move, i.e.
+// a non-pawn piece moving between two squares in either direction. Each key
+// lives in one of its two slots.
+std::array<uint64_t, 8192> cuckoo_keys{};
+std::array<Move, 8192> cuckoo_moves{};
+
+inline int cuckoo_h1(uint64_t key) { return key & 0x1fff; }
+inline int cuckoo_h2(uint64_t key) { return (key >> 16) & 0x1fff; }
+
+// The library keeps its Zobrist keys private. They are recovered by hashing
+// an empty board against one holding a single piece or the other side to move.
+uint64_t zobrist_piece(Piece piece, Square sq) {
+    std::string fen;
+    for (int rank = 7; rank >= 0; rank--) {
+        int file = sq.file();
+        if (rank != sq.rank()) {
+            fen += "8";
+        } else {
+            fen += file > 0 ? std::to_string(file) : "";
+            fen += static_cast<std::string>(piece);
+            fen += file < 7 ? std::to_string(7 - file) : "";
+        }
+        fen += rank > 0 ? "/" : " w - - 0 1";
+    }
+    return Board(fen).zobrist() ^ Board("8/8/8/8/8/8/8/8 w - - 0 1").zobrist();
+}
+
+uint64_t zobrist_side() {
+    return Board("8/8/8/8/8/8/8/8 w - - 0 1").zobrist() ^ Board("8/8/8/8/8/8/8/8 b - - 0 1").zobrist();
+}
+
+void init_pawn_keys() {
+    for (Piece piece : {Piece::WHITEPAWN, Piece::BLACKPAWN}) {
+        for (int sq = 8; sq < 56; sq++) {
+            pawn_keys[piece][sq] = zobrist_piece(piece, Square(sq));
+        }
+    }
+}
+
+void init_cuckoo() {
+    uint64_t side = zobrist_side();
+
+    for (int p = 0; p < 12; p++) {
+        Piece piece = Piece(static_cast<Piece::underlying>(p));
+        if (piece.type() == PieceType::PAWN) {
+            continue;
+        }
+
+        for (int s1 = 0; s1 < 64; s1++) {
+            for (int s2 = s1 + 1; s2 < 64; s2++) {
+                Bitboard reach;
+                switch (static_cast<int>(piece.type())) {
+                case static_cast<int>(PieceType::KNIGHT): reach = attacks::knight(Square(s1)); break;
+                case static_cast<int>(PieceType::BISHOP): reach = attacks::bishop(Square(s1), 0); break;
+                case static_cast<int>(PieceType::ROOK):   reach = attacks::rook(Square(s1), 0); break;
+                case static_cast<int>(PieceType::QUEEN):  reach = attacks::queen(Square(s1), 0); break;
+                default:                                  reach = attacks::king(Square(s1)); break;
+                }
+                if (!reach.check(s2)) {
+                    continue;
+                }
+
+                Move move = Move::make<Move::NORMAL>(Square(s1), Square(s2));
+                uint64_t key = zobrist_piece(piece, Square(s1)) ^ zobrist_piece(piece, Square(s2)) ^ side;
+
+                // Displace entries until one lands in an empty slot
+                int i = cuckoo_h1(key);
+                while (true) {
+                    std::swap(cuckoo_keys[i], key);
+                    std::swap(cuckoo_moves[i], move);
+                    if (move.move() == 0) {
+                        break;
+                    }
+                    i = i == cuckoo_h1(key) ? cuckoo_h2(key) : cuckoo_h1(key);
+                }
+            }
+        }
+    }
+}
+
+bool NoisyBoard::has_game_cycle(int ply) const {
+    int end = repetition_window();
+    if (end < 3) {
+        return false;
+    }
+
+    int size = static_cast<int>(prev_states_.size());
+    for (int i = 3; i <= end; i += 2) {
+        uint64_t move_key = hash() ^ prev_states_[size - i].hash;
+
+        int slot = cuckoo_h1(move_key);
+        if (cuckoo_keys[slot] != move_key) {
+            slot = cuckoo_h2(move_key);
+            if (cuckoo_keys[slot] != move_key) {
+                continue;
+            }
+        }
+
+        // The move must be playable, i.e. nothing may stand in between
+        Move move = cuckoo_moves[slot];
+        Square s1 = move.from();
+        Square s2 = move.to();
+        bool slider = !attacks::knight(s1).check(s2.index()) && !attacks::king(s1).check(s2.index());
+        if (slider && !attacks::queen(s1, occ()).check(s2.index())) {
+            continue;
+        }
+
+        // Cycles reaching back before the root are left to is_repetition()
+        if (ply > i) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Pawn structure terms, from white's point of view
+constexpr Score DOUBLED_PAWN = toScore(eval_params::DOUBLED_PAWN);
+constexpr Score ISOLATED_PAWN = toScore(eval_params::ISOLATED_PAWN);
+constexpr Score BACKWARD_PAWN = toScore(eval_params::BACKWARD_PAWN);
+// Bonus of a passed pawn by relative rank, on top of its piece-square score
+constexpr std::array<Score, 8> PASSED_PAWN = [] {
+    std::array<Score, 8> scores{};
+    for (int rank = 0; rank < 8; rank++) {
+        scores[rank] = toScore(eval_params::PASSED_PAWN[rank]);
+    }
+    return scores;
+}();
+
+// Squares in front of a pawn on its own file, indexed by [color][square]
+constexpr std::array<std::array<uint64_t, 64>, 2> forwardFile = [] {
+    std::array<std::array<uint64_t, 64>, 2> masks{};
+    for (int sq = 0; sq < 64; sq++) {
+        for (int r = sq / 8 + 1; r < 8; r++) {
+            masks[0][sq] |= 1ULL << (r * 8 + sq % 8);
+        }
+        for (int r = sq / 8 - 1; r >= 0; r--) {
+            masks[1][sq] |= 1ULL << (r * 8 + sq % 8);
+        }
+    }
+    return masks;
+}();
+
+constexpr std::array<uint64_t, 8> adjacentFiles = [] {
+    std::array<uint64_t, 8> masks{};
+    for (int f = 0; f < 8; f++) {
+        for (int r = 0; r < 8; r++) {
+            masks[f] |= (f > 0 ? 1ULL << (r * 8 + f - 1) : 0) | (f < 7 ? 1ULL << (r * 8 + f + 1) : 0);
+        }
+    }
+    return masks;
+}();
+
+// Squares on the adjacent files that are level with or behind a pawn, where
+// the pawns that could still defend it stand
+constexpr std::array<std::array<uint64_t, 64>, 2> supportSpan = [] {
+    std::array<std::array<uint64_t, 64>, 2> masks{};
+    for (int sq = 0; sq < 64; sq++) {
+        uint64_t adjacent = adjacentFiles[sq % 8];
+        masks[0][sq] = adjacent & ~(forwardFile[0][sq] | forwardFile[0][sq] << 1 | forwardFile[0][sq] >> 1);
+        masks[1][sq] = adjacent & ~(forwardFile[1][sq] | forwardFile[1][sq] << 1 | forwardFile[1][sq] >> 1);
+    }
+    return masks;
+}();
+
+// Squares that enemy pawns must not occupy for a pawn to be passed
+constexpr std::array<std::array<uint64_t, 64>, 2> passedSpan = [] {
+    std::array<std::array<uint64_t, 64>, 2> masks{};
+    for (int c = 0; c < 2; c++) {
+        for (int sq = 0; sq < 64; sq++) {
+            uint64_t front = forwardFile[c][sq];
+            masks[c][sq] = front | ((front << 1) & ~0x0101010101010101ULL) | ((front >> 1) & ~0x8080808080808080ULL);
+        }
+    }
+    return masks;
+}();
+
+struct PawnEntry {
+    uint64_t key = 0;
+    Score score = 0;
+    std::array<Bitboard, 2> passed{};
+};
+
+// Doubled, isolated, backward and passed pawns of both sides. Depends on the
+// pawns alone, so the result can be cached under the pawn key.
+PawnEntry evaluate_pawns(const Board &board) {
+    PawnEntry entry;
+
+    for (Color us : {Color::WHITE, Color::BLACK}) {
+        Color them = ~us;
+        Bitboard ours = board.pieces(PieceType::PAWN, us);
+        Bitboard theirs = board.pieces(PieceType::PAWN, them);
+        Score total = 0;
+
+        for (Bitboard pawns = ours; !pawns.empty();) {
+            Square sq = pawns.pop();
+            int index = sq.index();
+            int stop = us == Color::WHITE ? index + 8 : index - 8;
+
+            if (ours & forwardFile[us][index]) {
+                total += DOUBLED_PAWN;
+                TRACE(us, term::DOUBLED_PAWN, 1);
+            }
+            if (!(ours & adjacentFiles[sq.file()])) {
+                total += ISOLATED_PAWN;
+                TRACE(us, term::ISOLATED_PAWN, 1);
+            } else if (!(ours & supportSpan[us][index]) && (attacks::pawn(us, Square(stop)) & theirs)) {
+                total += BACKWARD_PAWN;
+                TRACE(us, term::BACKWARD_PAWN, 1);
+            }
+            if (!(theirs & passedSpan[us][index]) && !(ours & forwardFile[us][index])) {
+                int rank = sq.relative_square(us).rank();
+                entry.passed[us] |= Bitboard::fromSquare(sq);
+                total += PASSED_PAWN[rank];
+                TRACE(us, term::PASSED_PAWN + rank, 1);
+            }
+        }
+
+        entry.score += us == Color::WHITE ? total : -total;
+    }
+
+    return entry;
+}
+
+// Direct-mapped cache of evaluate_pawns(), one per search thread
+class PawnTable {
+public:
+    static constexpr size_t SIZE = 8192;
+
+    const PawnEntry &probe(const NoisyBoard &board) {
+        PawnEntry &entry = entries_[board.pawnKey() & (SIZE - 1)];
+        probes_++;
+        if (entry.key == board.pawnKey()) {
+            hits_++;
+        } else {
+            entry = evaluate_pawns(board);
+            entry.key = board.pawnKey();
+        }
+        return entry;
+    }
+
+    long long probes() const { return probes_; }
+    long long hits() const { return hits_; }
+
+    void clear_stats() {
+        probes_ = 0;
+        hits_ = 0;
+    }
+
+private:
+    std::array<PawnEntry, SIZE> entries_{};
+    long long probes_ = 0;
+    long long hits_ = 0;
+};
+
+// Evaluation of an endgame known to be won by strong, from the point of
+// view of the side to move. Replaces the general evaluation.
+using EndgameEval = int (*)(const Board &board, Color strong);
+
+// Added to the score of won endgames so that search steers into them
+const int KNOWN_WIN = 1000;
+
+// King and enough material to mate against a bare king: drive the defending
+// king to the edge and bring the other king closer
+int evaluate_kxk(const Board &board, Color strong) {
+    Square winner = board.kingSq(strong);
+    Square loser = board.kingSq(~strong);
+
+    int material = 0;
+    for (PieceType pt : {PieceType::PAWN, PieceType::KNIGHT, PieceType::BISHOP, PieceType::ROOK, PieceType::QUEEN}) {
+        material += board.pieces(pt, strong).count() * pieceValue(pt);
+    }
+    int edge = std::max(std::abs(2 * static_cast<int>(loser.file()) - 7), std::abs(2 * static_cast<int>(loser.rank()) - 7));
+    int value = std::min(KNOWN_WIN + material + 20 * edge + 10 * (7 - Square::distance(winner, loser)), EVAL_MAX);
+
+    return board.sideToMove() == strong ? value : -value;
+}
+
+// Everything the evaluation derives from the piece counts alone
+struct MaterialEntry {
+    uint64_t key = 0;
+    // From white's point of view
+    Score imbalance = 0;
+    int phase = 0;
+    // Endgame scale factor of each side, used when the score favours it
+    std::array<uint8_t, 2> scale{{SCALE_NORMAL, SCALE_NORMAL}};
+    EndgameEval endgame = nullptr;
+    Color strong = Color::WHITE;
+};
+
+// Imbalance terms: the bishop pair, and knights gaining and rooks losing
+// value with every own pawn above five
+constexpr Score BISHOP_PAIR = toScore(eval_params::BISHOP_PAIR);
+constexpr Score KNIGHT_PAWN_ADJUST = toScore(eval_params::KNIGHT_PAWN_ADJUST);
+constexpr Score ROOK_PAWN_ADJUST = toScore(eval_params::ROOK_PAWN_ADJUST);
+
+// counts is indexed by chess::Piece
+MaterialEntry evaluate_material(const std::array<uint8_t, 12> &counts) {
+    MaterialEntry entry;
+    std::array<int, 2> non_pawn{};
+
+    for (int piece = 0; piece < 12; piece++) {
+        entry.phase += counts[piece] * piecePhase[piece];
+    }
+
+    for (int c = 0; c < 2; c++) {
+        const uint8_t *own = &counts[c * 6];
+        non_pawn[c] = own[1] * pieceInfos[1].materialValue + own[2] * pieceInfos[2].materialValue
+                    + own[3] * pieceInfos[3].materialValue + own[4] * pieceInfos[4].materialValue;
+
+        Score imbalance = (own[2] >= 2 ? BISHOP_PAIR : 0)
+                        + (own[0] - 5) * (own[1] * KNIGHT_PAWN_ADJUST + own[3] * ROOK_PAWN_ADJUST);
+        entry.imbalance += c == 0 ? imbalance : -imbalance;
+        TRACE(c == 0 ? Color::WHITE : Color::BLACK, term::BISHOP_PAIR, own[2] >= 2);
+        TRACE(c == 0 ? Color::WHITE : Color::BLACK, term::KNIGHT_PAWN_ADJUST, (own[0] - 5) * own[1]);
+        TRACE(c == 0 ? Color::WHITE : Color::BLACK, term::ROOK_PAWN_ADJUST, (own[0] - 5) * own[3]);
+    }
+
+    for (int c = 0; c < 2; c++) {
+        int own_pawns = counts[c * 6];
+        int their_pawns = counts[(c ^ 1) * 6];
+
+        const uint8_t *own = &counts[c * 6];
+        // Two knights cannot force mate even against a bare king
+        bool can_mate = own_pawns > 0 || own[4] > 0 || own[3] > 0 || own[2] >= 2 || (own[2] > 0 && own[1] > 0)
+                     || own[1] >= 3;
+
+        // Without pawns, a minor piece more is not enough to win
+        if (own_pawns == 0 && non_pawn[c] - non_pawn[c ^ 1] <= pieceInfos[2].materialValue) {
+            entry.scale[c] = non_pawn[c] < pieceInfos[3].materialValue ? 0
+                           : non_pawn[c ^ 1] <= pieceInfos[2].materialValue ? 4 : 14;
+        }
+        if (!can_mate) {
+            entry.scale[c] = 0;
+        }
+
+        if (can_mate && non_pawn[c] >= pieceInfos[3].materialValue && non_pawn[c ^ 1] == 0 && their_pawns == 0) {
+            entry.endgame = evaluate_kxk;
+            entry.strong = Color(static_cast<Color::underlying>(c));
+        }
+    }
+
+    return entry;
+}
+
+// Direct-mapped cache of evaluate_material(), one per search thread
+class MaterialTable {
+public:
+    static constexpr size_t SIZE = 1024;
+
+    const MaterialEntry &probe(const NoisyBoard &board) {
+        MaterialEntry &entry = entries_[board.materialKey() & (SIZE - 1)];
+        probes_++;
+        if (entry.key == board.materialKey()) {
+            hits_++;
+        } else {
+            entry = evaluate_material(board.pieceCounts());
+            entry.key = board.materialKey();
+        }
+        return entry;
+    }
+
+    long long probes() const { return probes_; }
+    long long hits() const { return hits_; }
+
+    void clear_stats() {
+        probes_ = 0;
+        hits_ = 0;
+    }
+
+private:
+    std::array<MaterialEntry, SIZE> entries_{};
+    long long probes_ = 0;
+    long long hits_ = 0;
+};
+
+// Direct-mapped cache of static evaluations keyed on Board::hash(). Every
+// entry is a single word holding the upper 48 bits of the key and the
+// 16-bit score, so it is written and read atomically and a torn or
+// overwritten entry fails the key check. The table can therefore be shared
+// between threads without locks.
+class EvalCache {
+public:
+    static constexpr size_t SIZE = 65536;
+
+    bool probe(uint64_t key, int &value) {
+        uint64_t entry = entries_[key & (SIZE - 1)].load(std::memory_order_relaxed);
+        probes_++;
+        if ((entry ^ key) >> 16 != 0) {
+            return false;
+        }
+        hits_++;
+        value = static_cast<int16_t>(entry);
+        return true;
+    }
+
+    // value must fit the 16 bits of the entry, which evaluate() guarantees;
+    // clamped again so that a caller breaking that cannot wrap the score
+    void store(uint64_t key, int value) {
+        value = std::clamp(value, -EVAL_MAX, EVAL_MAX);
+        uint64_t entry = (key & ~0xFFFFULL) | static_cast<uint16_t>(value);
+        entries_[key & (SIZE - 1)].store(entry, std::memory_order_relaxed);
+    }
+
+    // Needed whenever the evaluation function itself changes
+    void clear() {
+        for (auto &entry : entries_) {
+            entry.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    long long probes() const { return probes_; }
+    long long hits() const { return hits_; }
+
+    void clear_stats() {
+        probes_ = 0;
+        hits_ = 0;
+    }
+
+private:
+    std::array<std::atomic<uint64_t>, SIZE> entries_{};
+    long long probes_ = 0;
+    long long hits_ = 0;
+};
+
+// Evaluation caches of one search thread
+struct EvalTables {
+    EvalCache evals;
+    PawnTable pawns;
+    MaterialTable material;
+
+    void clear_stats() {
+        evals.clear_stats();
+        pawns.clear_stats();
+        material.clear_stats();
+    }
+};
+
+// Indexed by search thread id, kept across searches
+std::vector<std::unique_ptr<EvalTables>> eval_tables;
+
+void clear_eval_caches() {
+    for (auto &tables : eval_tables) {
+        tables->evals.clear();
+    }
+}
+
+// Probes and hits of the eval cache, pawn table and material table
+struct CacheStats {
+    std::array<long long, 3> probes{};
+    std::array<long long, 3> hits{};
+
+    CacheStats &operator+=(const CacheStats &other) {
+        for (int i = 0; i < 3; i++) {
+            probes[i] += other.probes[i];
+            hits[i] += other.hits[i];
+        }
+        return *this;
+    }
+
+    std::string str() const {
+        static constexpr const char *names[] = {"evalcache", "pawns", "material"};
+        std::ostringstream out;
+        for (int i = 0; i < 3; i++) {
+            out << (i ? " " : "") << names[i] << " " << hits[i] << "/" << probes[i]
+                << " (" << hits[i] * 100 / std::max(probes[i], 1LL) << "%)";
+        }
+        return out.str();
+    }
+};
+
+// Statistics of all given tables since they were last cleared
+CacheStats cache_stats(const std::vector<std::unique_ptr<EvalTables>> &tables) {
+    CacheStats stats;
+    for (const auto &t : tables) {
+        stats.probes[0] += t->evals.probes();
+        stats.hits[0] += t->evals.hits();
+        stats.probes[1] += t->pawns.probes();
+        stats.hits[1] += t->pawns.hits();
+        stats.probes[2] += t->material.probes();
+        stats.hits[2] += t->material.hits();
+    }
+    return stats;
+}
+
+// Squares attacked by each side, built in one pass over the pieces so that
+// every slider lookup is done once per position. The evaluation derives
+// all its attack-based terms from it, and search heuristics can build one
+// for the same price.
+struct AttackMap {
+    // Indexed by [color][PieceType]
+    std::array<std::array<Bitboard, 6>, 2> by_type{};
+    std::array<Bitboard, 2> all{};
+    // Squares attacked at least twice
+    std::array<Bitboard, 2> twice{};
+    // King and the squares around it
+    std::array<Bitboard, 2> king_zone{};
+
+    // Filled by build() on the way, from each side's point of view
+    std::array<Score, 2> mobility{};
+    // Pieces attacking the enemy king zone and their summed weights
+    std::array<int, 2> king_attackers{};
+    std::array<Score, 2> king_attack_weight{};
+#if TUNE
+    std::array<std::array<int, 6>, 2> king_attackers_by_type{};
+#endif
+
+    explicit AttackMap(const Board &board);
+
+    Bitboard attacked_by(Color color, PieceType type) const { return by_type[color][type]; }
+
+private:
+    void add(Color color, PieceType type, Bitboard attacks) {
+        by_type[color][type] |= attacks;
+        twice[color] |= all[color] & attacks;
+        all[color] |= attacks;
+    }
+};
+
+// Mobility: per square a piece can move to beyond the usual number
+// (MOBILITY_BASE), not counting squares held by own pawns or king or
+// attacked by enemy pawns. Indexed by PieceType.
+constexpr std::array<Score, 6> MOBILITY_WEIGHT = [] {
+    std::array<Score, 6> scores{};
+    for (int pt = 0; pt < 6; pt++) {
+        scores[pt] = toScore(eval_params::MOBILITY[pt]);
+    }
+    return scores;
+}();
+constexpr std::array<int, 6> MOBILITY_BASE{{0, 4, 6, 7, 14, 0}};
+
+// King safety: weight of each piece attacking the enemy king zone, and the
+// percentage of the summed weights that counts for a number of attackers
+constexpr std::array<Score, 6> KING_ATTACK_WEIGHT = [] {
+    std::array<Score, 6> scores{};
+    for (int pt = 0; pt < 6; pt++) {
+        scores[pt] = toScore(eval_params::KING_ATTACK_WEIGHT[pt]);
+    }
+    return scores;
+}();
+constexpr std::array<int, 8> KING_ATTACK_SCALE{{0, 0, 50, 75, 88, 94, 97, 99}};
+
+// Non-pawn pieces attacked by an enemy pawn, or by a minor piece when they
+// are worth more, and pieces attacked and not defended at all
+constexpr Score THREAT_BY_PAWN = toScore(eval_params::THREAT_BY_PAWN);
+constexpr Score THREAT_BY_MINOR = toScore(eval_params::THREAT_BY_MINOR);
+constexpr Score HANGING_PIECE = toScore(eval_params::HANGING_PIECE);
+
+AttackMap::AttackMap(const Board &board) {
+    Bitboard occupied = board.occ();
+
+    for (Color color : {Color::WHITE, Color::BLACK}) {
+        Bitboard pawns = board.pieces(PieceType::PAWN, color);
+        if (color == Color::WHITE) {
+            add(color, PieceType::PAWN, attacks::pawnLeftAttacks<Color::WHITE>(pawns));
+            add(color, PieceType::PAWN, attacks::pawnRightAttacks<Color::WHITE>(pawns));
+        } else {
+            add(color, PieceType::PAWN, attacks::pawnLeftAttacks<Color::BLACK>(pawns));
+            add(color, PieceType::PAWN, attacks::pawnRightAttacks<Color::BLACK>(pawns));
+        }
+
+        Square king = board.kingSq(color);
+        king_zone[color] = attacks::king(king) | Bitboard::fromSquare(king);
+        add(color, PieceType::KING, attacks::king(king));
+    }
+
+    for (Color color : {Color::WHITE, Color::BLACK}) {
+        Color them = ~color;
+        Bitboard area = ~(board.pieces(PieceType::PAWN, color) | board.pieces(PieceType::KING, color)
+                          | attacked_by(them, PieceType::PAWN));
+
+        for (PieceType type : {PieceType::KNIGHT, PieceType::BISHOP, PieceType::ROOK, PieceType::QUEEN}) {
+            for (Bitboard pieces = board.pieces(type, color); !pieces.empty();) {
+                Square sq = pieces.pop();
+                Bitboard attacks = type == PieceType::KNIGHT ? attacks::knight(sq)
+                                 : type == PieceType::BISHOP ? attacks::bishop(sq, occupied)
+                                 : type == PieceType::ROOK   ? attacks::rook(sq, occupied)
+                                                             : attacks::queen(sq, occupied);
+                add(color, type, attacks);
+
+                int moves = static_cast<int>((attacks & area).count()) - MOBILITY_BASE[type];
+                mobility[color] += MOBILITY_WEIGHT[type] * moves;
+                TRACE(color, term::MOBILITY + type, moves);
+                if (attacks & king_zone[them]) {
+                    king_attackers[color]++;
+                    king_attack_weight[color] += KING_ATTACK_WEIGHT[type];
+#if TUNE
+                    king_attackers_by_type[color][type]++;
+#endif
+                }
+            }
+        }
+    }
+}
+
+// Mobility, king attacks and threats, from white's point of view
+Score evaluate_attacks(const Board &board) {
+    AttackMap map(board);
+    Score total = 0;
+
+    for (Color us : {Color::WHITE, Color::BLACK}) {
+        Color them = ~us;
+        Score score = map.mobility[us];
+
+        int attackers = std::min(map.king_attackers[us], 7);
+        Score weight = map.king_attack_weight[us];
+        score += makeScore(mgScore(weight) * KING_ATTACK_SCALE[attackers] / 100,
+                           egScore(weight) * KING_ATTACK_SCALE[attackers] / 100);
+#if TUNE
+        for (int type = 0; type < 6; type++) {
+            TRACE(us, term::KING_ATTACK_WEIGHT + type,
+                  map.king_attackers_by_type[us][type] * KING_ATTACK_SCALE[attackers] / 100.0);
+        }
+#endif
+
+        Bitboard targets = board.us(them) & ~board.pieces(PieceType::PAWN, them) & ~board.pieces(PieceType::KING, them);
+        Bitboard minor_targets = board.pieces(PieceType::ROOK, them) | board.pieces(PieceType::QUEEN, them);
+        Bitboard minor_attacks = map.attacked_by(us, PieceType::KNIGHT) | map.attacked_by(us, PieceType::BISHOP);
+        int pawn_threats = static_cast<int>((targets & map.attacked_by(us, PieceType::PAWN)).count());
+        int minor_threats = static_cast<int>((minor_targets & minor_attacks).count());
+        int hanging = static_cast<int>((targets & map.all[us] & ~map.all[them]).count());
+        score += THREAT_BY_PAWN * pawn_threats + THREAT_BY_MINOR * minor_threats + HANGING_PIECE * hanging;
+        TRACE(us, term::THREAT_BY_PAWN, pawn_threats);
+        TRACE(us, term::THREAT_BY_MINOR, minor_threats);
+        TRACE(us, term::HANGING_PIECE, hanging);
+
+        total += us == Color::WHITE ? score : -score;
+    }
+
+    return total;
+}
+
+// total is the material, piece-square and pawn score from the side to
+// move's point of view
+int finish_score(const Board &board, Score total, const MaterialEntry &material) {
+    Color us = board.sideToMove();
+    Score attacks = evaluate_attacks(board);
+    total += us == Color::WHITE ? material.imbalance + attacks : -(material.imbalance + attacks);
+
+    Color strong = egScore(total) > 0 ? us : ~us;
+    return std::clamp(taper(total, material.phase, material.scale[strong]), -EVAL_MAX, EVAL_MAX);
+}
+
+int score_from_scratch(const Board &board) {
+    std::array<uint8_t, 12> counts{};
+    for (int piece = 0; piece < 12; piece++) {
+        Piece p = Piece(static_cast<Piece::underlying>(piece));
+        counts[piece] = static_cast<uint8_t>(board.pieces(p.type(), p.color()).count());
+    }
+    MaterialEntry material = evaluate_material(counts);
+    if (material.endgame) {
+        return material.endgame(board, material.strong);
+    }
+
+    Score total = 0;
+    for (Bitboard pieces = board.occ(); !pieces.empty();) {
+        Square sq = pieces.pop();
+        Piece piece = board.at(sq);
+        Score value = pieceSquareScores[piece][sq.index()];
+        total += piece.color() == board.sideToMove() ? value : -value;
+    }
+
+    Score pawns = evaluate_pawns(board).score;
+    total += board.sideToMove() == Color::WHITE ? pawns : -pawns;
+
+    return finish_score(board, total, material);
+}
+
+// Static evaluation without the eval cache
+int evaluate(const NoisyBoard &board, EvalTables &tables) {
+    if (use_nnue) {
+        // A network loaded from EvalFile may produce any value
+        return std::clamp(nnue::evaluate(*nnue_network, board.accumulator(), board.sideToMove()), -EVAL_MAX, EVAL_MAX);
+    }
+
+#if INCREMENTAL_EVAL
+    const MaterialEntry &material = tables.material.probe(board);
+    if (material.endgame) {
+        return material.endgame(board, material.strong);
+    }
+
+    Color us = board.sideToMove();
+    Color them = ~us;
+
+    Score pawns = tables.pawns.probe(board).score;
+    Score total = board.psqtScore(us) - board.psqtScore(them) + (us == Color::WHITE ? pawns : -pawns);
+
+    return finish_score(board, total, material);
+#else
+    return score_from_scratch(board);
+#endif
+}
+
+int score(const NoisyBoard &board, EvalTables &tables) {
+    int value;
+    if (!tables.evals.probe(board.hash(), value)) {
+        value = evaluate(board, tables);
+        tables.evals.store(board.hash(), value);
+    }
+    return value;
+}
+
+// A network that reproduces the middlegame half of the material and
+// piece-square evaluation (a linear network cannot taper): every hidden
+// neuron of a perspective sees the material + piece-square sum x of that
+// side's pieces, and neuron j is offset by -j * QA, so the clipped
+// neurons add up to x + REFERENCE_OFFSET for any x in
+// [-REFERENCE_OFFSET, HIDDEN * QA - REFERENCE_OFFSET].
+const int REFERENCE_OFFSET = 1000;
+
+std::unique_ptr<nnue::Network> reference_network() {
+    auto net = std::make_unique<nnue::Network>();
+
+    for (int piece = 0; piece < 12; piece++) {
+        for (int sq = 0; sq < 64; sq++) {
+            // Seen from white, so own pieces are the white ones
+            int value = piece < 6 ? mgScore(pieceSquareScores[piece][sq]) : 0;
+            net->feature_weights[nnue::feature_index(piece, sq, 0)].fill(static_cast<int16_t>(value));
+        }
+    }
+    for (int i = 0; i < nnue::HIDDEN; i++) {
+        net->feature_bias[i] = static_cast<int16_t>(REFERENCE_OFFSET - i * nnue::QA);
+    }
+    net->output_weights[0].fill(1);
+    net->output_weights[1].fill(-1);
+    net->output_bias = 0;
+    net->output_scale = 1;
+    return net;
+}
+
+// Loads eval_file unless a network is already there; reports failures to
+// the GUI and leaves NNUE off in that case
+bool load_network() {
+    if (nnue_network) {
+        return true;
+    }
+
+    std::string error;
+    auto net = nnue::load(eval_file, error);
+    if (!net) {
+        std::cout << "info string NNUE disabled: " << error << std::endl;
+        return false;
+    }
+
+    nnue_network = std::move(net);
+    std::cout << "info string NNUE " << eval_file << " loaded, " << nnue::kernels.name << " kernels" << std::endl;
+    return true;
+}
+
+struct SearchTimeoutException : public std::exception {
+    const char* what() const noexcept override {
+        return "Search timeout";
+    }
+};
+
+enum class Bound : uint8_t {
+    NONE,
+    UPPER,
+    LOWER,
+    EXACT
+};
+
+struct TTData {
+    Move move;
+    int score;
+    int depth;
+    Bound bound;
+};
+
+// Entries are written without locks: the key is stored xor'ed with the data,
+// so an entry torn by a concurrent writer simply fails verification on probe.
+struct TTEntry {
+    std::atomic<uint64_t> key{0};
+    std::atomic<uint64_t> data{0};
+};
+
+// Four 16-byte entries fill exactly one cache line.
+struct alignas(64) TTBucket {
+    static constexpr int SIZE = 4;
+    TTEntry entries[SIZE];
+};
+
+class TranspositionTable {
+public:
+    TranspositionTable() {
+        resize(16);
+    }
+
+    void resize(size_t mb) {
+        bucketCount = std::max<size_t>(1, mb * 1024 * 1024 / sizeof(TTBucket));
+        buckets.reset(new TTBucket[bucketCount]);
+        generation = 0;
+    }
+
+    void clear() {
+        for (size_t i = 0; i < bucketCount; i++) {
+            for (auto &entry : buckets[i].entries) {
+                entry.key.store(0, std::memory_order_relaxed);
+                entry.data.store(0, std::memory_order_relaxed);
+            }
+        }
+        generation = 0;
+    }
+
+    void newSearch() {
+        generation = (generation + 1) & 63;
+    }
+
+    bool probe(uint64_t key, TTData &out) const {
+        const TTBucket &bucket = buckets[index(key)];
+
+        for (const auto &entry : bucket.entries) {
+            uint64_t data = entry.data.load(std::memory_order_relaxed);
+            uint64_t stored = entry.key.load(std::memory_order_relaxed);
+
+            if ((stored ^ data) == key && data != 0) {
+                out = unpack(data);
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    void store(uint64_t key, Move move, int score, int depth, Bound bound) {
+        TTBucket &bucket = buckets[index(key)];
+        TTEntry *replace = &bucket.entries[0];
+        int worst = MATE_VALUE;
+
+        for (auto &entry : bucket.entries) {
+            uint64_t data = entry.data.load(std::memory_order_relaxed);
+            uint64_t stored = entry.key.load(std::memory_order_relaxed);
+
+            if ((stored ^ data) == key || data == 0) {
+                // Keep the old best move when this search did not produce one
+                if (move.move() == Move::NO_MOVE && data != 0) {
+                    move = unpack(data).move;
+                }
+                replace = &entry;
+                break;
+            }
+
+            // Prefer overwriting shallow entries left over from earlier searches
+            int age = (generation - ((data >> 42) & 63)) & 63;
+            int value = static_cast<int>((data >> 32) & 0xFF) - 8 * age;
+            if (value < worst) {
+                worst = value;
+                replace = &entry;
+            }
+        }
+
+        uint64_t data = pack(move, score, depth, bound);
+        replace->data.store(data, std::memory_order_relaxed);
+        replace->key.store(key ^ data, std::memory_order_relaxed);
+    }
+
+    // Permill of sampled entries written during the current search
+    int hashfull() const {
+        int used = 0;
+        size_t samples = std::min<size_t>(250, bucketCount);
+
+        for (size_t i = 0; i < samples; i++) {
+            for (const auto &entry : buckets[i].entries) {
+                uint64_t data = entry.data.load(std::memory_order_relaxed);
+                if (data != 0 && ((data >> 42) & 63) == generation) {
+                    used++;
+                }
+            }
+        }
+        return used * 1000 / static_cast<int>(samples * TTBucket::SIZE);
+    }
+
+private:
+    size_t index(uint64_t key) const {
+        return static_cast<size_t>((static_cast<unsigned __int128>(key) * bucketCount) >> 64);
+    }
+
+    // [0,16) move, [16,32) score, [32,40) depth, [40,42) bound, [42,48) generation
+    uint64_t pack(Move move, int score, int depth, Bound bound) const {
+        return static_cast<uint64_t>(move.move())
+            | static_cast<uint64_t>(static_cast<uint16_t>(score)) << 16
+            | static_cast<uint64_t>(static_cast<uint8_t>(depth)) << 32
+            | static_cast<uint64_t>(bound) << 40
+            | static_cast<uint64_t>(generation) << 42;
+    }
+
+    static TTData unpack(uint64_t data) {
+        TTData out;
+        out.move = Move(static_cast<uint16_t>(data));
+        out.score = static_cast<int16_t>(data >> 16);
+        out.depth = static_cast<int8_t>(data >> 32);
+        out.bound = static_cast<Bound>((data >> 40) & 3);
+        return out;
+    }
+
+    std::unique_ptr<TTBucket[]> buckets;
+    size_t bucketCount = 0;
+    uint8_t generation = 0;
+};
+
+TranspositionTable tt;
+
+// Mate and tablebase scores are stored relative to the node, not to the root
+inline int score_to_tt(int score, int ply) {
+    if (score >= TB_BOUND) return score + ply;
+    if (score <= -TB_BOUND) return score - ply;
+    return score;
+}
+
+inline int score_from_tt(int score, int ply) {
+    if (score >= TB_BOUND) return score - ply;
+    if (score <= -TB_BOUND) return score + ply;
+    return score;
+}
+
+inline bool tt_cutoff(const TTData &entry, int alpha, int beta, int score) {
+    return entry.bound == Bound::EXACT
+        || (entry.bound == Bound::LOWER && score >= beta)
+        || (entry.bound == Bound::UPPER && score <= alpha);
+}
+
+// Most valuable victim first, least valuable attacker as tie break
+inline int mvv_lva(const Board &board, Move move) {
+    PieceType victim = move.typeOf() == Move::ENPASSANT ? PieceType(PieceType::PAWN) : board.at<PieceType>(move.to());
+    PieceType attacker = board.at<PieceType>(move.from());
+    int score = 8 * static_cast<int>(victim) + 5 - static_cast<int>(attacker);
+
+    if (move.typeOf() == Move::PROMOTION) {
+        score += move.promotionType() == PieceType::QUEEN ? 8 * static_cast<int>(PieceType::QUEEN) : -100;
+    }
+    return score;
+}
+
+// Pieces of both colours attacking square, seen through occupied
+inline Bitboard attackers_to(const Board &board, Square square, Bitboard occupied) {
+    Bitboard bishops = board.pieces(PieceType::BISHOP) | board.pieces(PieceType::QUEEN);
+    Bitboard rooks = board.pieces(PieceType::ROOK) | board.pieces(PieceType::QUEEN);
+
+    return (attacks::pawn(Color::BLACK, square) & board.pieces(PieceType::PAWN, Color::WHITE))
+         | (attacks::pawn(Color::WHITE, square) & board.pieces(PieceType::PAWN, Color::BLACK))
+         | (attacks::knight(square) & board.pieces(PieceType::KNIGHT))
+         | (attacks::bishop(square, occupied) & bishops)
+         | (attacks::rook(square, occupied) & rooks)
+         | (attacks::king(square) & board.pieces(PieceType::KING));
+}
+
+// Material won by a capture or promotion, before any recapture
+inline int capture_gain(const Board &board, Move move) {
+    int gain = 0;
+    if (move.typeOf() == Move::ENPASSANT) {
+        gain = pieceValue(PieceType::PAWN);
+    } else if (board.at(move.to()) != Piece::NONE) {
+        gain = pieceValue(board.at<PieceType>(move.to()));
+    }
+    if (move.typeOf() == Move::PROMOTION) {
+        gain += pieceValue(move.promotionType()) - pieceValue(PieceType::PAWN);
+    }
+    return gain;
+}
+
+// True if the side to move has a pawn one push away from promoting
+inline bool pawn_on_seventh(const Board &board) {
+    return !(board.pieces(PieceType::PAWN, board.sideToMove())
+             & Bitboard(Rank(Rank::rank(Rank::RANK_7, board.sideToMove())))).empty();
+}
+
+// Static exchange evaluation: true if the exchange sequence started by move
+// on its target square wins at least threshold for the side to move, with
+// both sides always recapturing with their least valuable piece. Sliders
+// behind the capturing pieces join in as the square opens up (x-rays).
+// Pins are ignored.
+bool see(const Board &board, Move move, int threshold) {
+    if (move.typeOf() == Move::CASTLING) {
+        return threshold <= 0;
+    }
+
+    Square from = move.from();
+    Square to = move.to();
+    Bitboard occupied = board.occ() ^ Bitboard::fromSquare(from);
+
+    if (move.typeOf() == Move::ENPASSANT) {
+        occupied ^= Bitboard::fromSquare(to.ep_square());
+    }
+    int gain = capture_gain(board, move);
+    int on_square = pieceValue(move.typeOf() == Move::PROMOTION ? move.promotionType()
+                                                                : board.at<PieceType>(from));
+
+    // swap is the balance from the point of view of the side about to
+    // recapture, minus what it needs to reach
+    int swap = gain - threshold;
+    if (swap < 0) {
+        return false;
+    }
+    swap = on_square - swap;
+    if (swap <= 0) {
+        return true;
+    }
+
+    occupied |= Bitboard::fromSquare(to);
+    Bitboard attackers = attackers_to(board, to, occupied) & occupied;
+    Bitboard bishops = board.pieces(PieceType::BISHOP) | board.pieces(PieceType::QUEEN);
+    Bitboard rooks = board.pieces(PieceType::ROOK) | board.pieces(PieceType::QUEEN);
+    Color stm = board.sideToMove();
+    int result = 1;
+
+    while (true) {
+        stm = ~stm;
+        attackers &= occupied;
+        Bitboard stm_attackers = attackers & board.us(stm);
+        if (stm_attackers.empty()) {
+            break;
+        }
+        result ^= 1;
+
+        Bitboard bb;
+        if (!(bb = stm_attackers & board.pieces(PieceType::PAWN)).empty()) {
+            if ((swap = pieceValue(PieceType::PAWN) - swap) < result) break;
+            occupied ^= Bitboard::fromSquare(bb.lsb());
+            attackers |= attacks::bishop(to, occupied) & bishops;
+        } else if (!(bb = stm_attackers & board.pieces(PieceType::KNIGHT)).empty()) {
+            if ((swap = pieceValue(PieceType::KNIGHT) - swap) < result) break;
+            occupied ^= Bitboard::fromSquare(bb.lsb());
+        } else if (!(bb = stm_attackers & board.pieces(PieceType::BISHOP)).empty()) {
+            if ((swap = pieceValue(PieceType::BISHOP) - swap) < result) break;
+            occupied ^= Bitboard::fromSquare(bb.lsb());
+            attackers |= attacks::bishop(to, occupied) & bishops;
+        } else if (!(bb = stm_attackers & board.pieces(PieceType::ROOK)).empty()) {
+            if ((swap = pieceValue(PieceType::ROOK) - swap) < result) break;
+            occupied ^= Bitboard::fromSquare(bb.lsb());
+            attackers |= attacks::rook(to, occupied) & rooks;
+        } else if (!(bb = stm_attackers & board.pieces(PieceType::QUEEN)).empty()) {
+            if ((swap = pieceValue(PieceType::QUEEN) - swap) < result) break;
+            occupied ^= Bitboard::fromSquare(bb.lsb());
+            attackers |= (attacks::bishop(to, occupied) & bishops) | (attacks::rook(to, occupied) & rooks);
+        } else {
+            // The king may only recapture if the other side has nothing left
+            return (attackers & board.us(~stm)).empty() ? result : result ^ 1;
+        }
+    }
+
+    return result;
+}
+
+inline bool is_quiet(const Board &board, Move move) {
+    return !board.isCapture(move) && move.typeOf() != Move::PROMOTION;
+}
+
+// Moves the best scored move of [index, size) to index, so only as much of
+// the list gets ordered as the search actually visits before a cutoff.
+inline Move pick_next(Movelist &moves, int index) {
+    int best = index;
+    for (int i = index + 1; i < moves.size(); i++) {
+        if (moves[i].score() > moves[best].score()) {
+            best = i;
+        }
+    }
+    std::swap(moves[index], moves[best]);
+    return moves[index];
+}
+
+// The hash move may come from another position that shares the bucket
+// (or from a torn write), so it is checked against the moves of its piece.
+inline bool is_legal_move(const Board &board, Move move) {
+    if (move.move() == Move::NO_MOVE || move.move() == Move::NULL_MOVE) {
+        return false;
+    }
+
+    Piece piece = board.at(move.from());
+    if (piece == Piece::NONE || piece.color() != board.sideToMove()) {
+        return false;
+    }
+
+    Movelist moves;
+    movegen::legalmoves(moves, board, 1 << static_cast<int>(piece.type()));
+    return std::find(moves.begin(), moves.end(), move) != moves.end();
+}
+
+// Hands out moves in stages: hash move, winning and equal captures by
+// MVV-LVA, then quiet moves with queen promotions and killers first and the
+// rest by history, and finally the captures that lose material by SEE.
+// Captures and quiets are generated separately and only when reached.
+//
+// In quiescence (and not in check) only captures and queen promotions are
+// generated, under-promotions are skipped and losing captures are dropped.
+// In check all evasions are returned, since standing pat is not an option
+// there.
+class MovePicker {
+public:
+    MovePicker(const Board &board, Move hash_move, const SearchInfo &info, int ply, bool qsearch = false)
+        : board(board), hash_move(hash_move), info(info), ply(ply),
+          captures_only(qsearch && !board.inCheck()) {
+        if (!is_legal_move(board, hash_move)
+            || (captures_only && !is_quiescence_move(hash_move))) {
+            this->hash_move = Move::NO_MOVE;
+            stage = GEN_CAPTURES;
+        }
+    }
+
+    Move next() {
+        switch (stage) {
+        case HASH_MOVE:
+            stage = GEN_CAPTURES;
+            return hash_move;
+
+        case GEN_CAPTURES:
+            movegen::legalmoves<movegen::MoveGenType::CAPTURE>(moves, board);
+            for (auto &move : moves) {
+                move.setScore(mvv_lva(board, move));
+            }
+            index = 0;
+            stage = CAPTURES;
+            [[fallthrough]];
+
+        case CAPTURES:
+            while (index < moves.size()) {
+                Move move = pick_next(moves, index++);
+                if (move == hash_move || (captures_only && !is_quiescence_move(move))) {
+                    continue;
+                }
+                if (!see(board, move, 0)) {
+                    if (!captures_only) {
+                        bad_captures.add(move);
+                    }
+                    continue;
+                }
+                return move;
+            }
+            stage = GEN_QUIETS;
+            [[fallthrough]];
+
+        case GEN_QUIETS:
+            moves.clear();
+            if (captures_only) {
+                // Queen promotions are the only quiet moves quiescence looks at
+                if (pawn_on_seventh(board)) {
+                    movegen::legalmoves<movegen::MoveGenType::QUIET>(moves, board, PieceGenType::PAWN);
+                }
+            } else {
+                movegen::legalmoves<movegen::MoveGenType::QUIET>(moves, board);
+            }
+            for (auto &move : moves) {
+                move.setScore(quiet_score(move));
+            }
+            index = 0;
+            stage = QUIETS;
+            [[fallthrough]];
+
+        case QUIETS:
+            while (index < moves.size()) {
+                Move move = pick_next(moves, index++);
+                if (move != hash_move && (!captures_only || is_quiescence_move(move))) {
+                    return move;
+                }
+            }
+            index = 0;
+            stage = BAD_CAPTURES;
+            [[fallthrough]];
+
+        case BAD_CAPTURES:
+            if (index < bad_captures.size()) {
+                return bad_captures[index++];
+            }
+            stage = DONE;
+            [[fallthrough]];
+
+        case DONE:
+            break;
+        }
+        return Move::NO_MOVE;
+    }
+
+private:
+    enum Stage { HASH_MOVE, GEN_CAPTURES, CAPTURES, GEN_QUIETS, QUIETS, BAD_CAPTURES, DONE };
+
+    bool is_quiescence_move(Move move) const {
+        if (move.typeOf() == Move::PROMOTION) {
+            return move.promotionType() == PieceType::QUEEN;
+        }
+        return board.isCapture(move);
+    }
+
+    int16_t quiet_score(Move move) const {
+        if (move.typeOf() == Move::PROMOTION) {
+            return move.promotionType() == PieceType::QUEEN ? 20000 : -20000;
+        }
+        const auto &killers = info.stack[ply].killers;
+        if (move == killers[0]) return 16000;
+        if (move == killers[1]) return 15000;
+        return info.history[board.sideToMove()][move.from().index()][move.to().index()];
+    }
+
+    const Board &board;
+    Move hash_move;
+    const SearchInfo &info;
+    int ply;
+    bool captures_only;
+    Stage stage = HASH_MOVE;
+    Movelist moves;
+    Movelist bad_captures;
+    int index = 0;
+};
+
+// History gravity keeps every entry within [-HISTORY_MAX, HISTORY_MAX]
+inline void update_history(int16_t &entry, int bonus) {
+    entry += bonus - entry * std::abs(bonus) / HISTORY_MAX;
+}
+
+// Rewards the quiet move that caused a beta cutoff and penalises the
+// quiet moves searched before it
+void update_quiet_stats(SearchInfo &info, const Board &board, int ply, int depth,
+                        Move move, const Movelist &quiets_tried) {
+    auto &killers = info.stack[ply].killers;
+    if (killers[0] != move) {
+        killers[1] = killers[0];
+        killers[0] = move;
+    }
+
+    auto &history = info.history[board.sideToMove()];
+    int bonus = std::min(depth * depth, HISTORY_MAX / 4);
+
+    update_history(history[move.from().index()][move.to().index()], bonus);
+    for (const auto &quiet : quiets_tried) {
+        update_history(history[quiet.from().index()][quiet.to().index()], -bonus);
+    }
+}
+
+bool is_null_move_allowed(const NoisyBoard &board) {
+    const auto &counts = board.pieceCounts();
+    const uint8_t *own = &counts[board.sideToMove() == Color::WHITE ? 0 : 6];
+
+    // Only king and pawns left: zugzwang is likely
+    if (own[1] + own[2] + own[3] + own[4] == 0) {
+        return false;
+    }
+
+    int totalPieces = 0;
+    for (uint8_t count : counts) {
+        totalPieces += count;
+    }
+
+    return totalPieces > 6;
+}
+
+// Raised by "stop" from the UCI thread, or by the main search thread when
+// it finishes so that helper threads stop as well
+std::atomic<bool> stop_search{false};
+// Set during "go ponder" until "ponderhit"; the clock is ignored meanwhile
+std::atomic<bool> pondering{false};
+
+// Serializes output of the UCI and search threads
+std::mutex cout_mutex;
+
+// Tables found under TablebasePath
+tb::Tablebases tablebases;
+// Positions with as many pieces as the largest table are only probed from
+// this depth on, smaller ones at every depth
+int tb_probe_depth = 1;
+
+inline bool should_stop(const SearchInfo &info) {
+    return info.stopped;
+}
+
+// Called once per node; only every TIME_CHECK_INTERVAL calls actually looks
+// at the stop flag and the clock and updates info.stopped.
+inline void poll_stop(SearchInfo &info) {
+    if (--info.polls_left > 0) {
+        return;
+    }
+    info.polls_left = TIME_CHECK_INTERVAL;
+
+    if (info.max_nodes) {
+        // Poll often enough to stop exactly at the node budget
+        info.polls_left = static_cast<int>(std::clamp<long long>(info.max_nodes - info.nodes, 1, TIME_CHECK_INTERVAL));
+        if (info.nodes >= info.max_nodes) {
+            info.stopped = true;
+        }
+    }
+
+    if (stop_search.load(std::memory_order_relaxed)) {
+        info.stopped = true;
+    } else if (!pondering.load(std::memory_order_relaxed)
+               && std::chrono::high_resolution_clock::now() > info.max_time) {
+        info.stopped = true;
+    }
+}
+
+std::chrono::milliseconds get_duration(std::chrono::time_point<std::chrono::high_resolution_clock> start) {
+    auto current_time = std::chrono::high_resolution_clock::now();
+    return std::chrono::duration_cast<std::chrono::milliseconds>(current_time - start);
+}
+
+// Makes move followed by the child's PV the PV of this ply
+inline void update_pv(SearchInfo &info, int ply, Move move) {
+    SearchStack &ss = info.stack[ply];
+    const SearchStack &child = info.stack[ply + 1];
+
+    ss.pv[0] = move;
+    std::copy(child.pv.begin(), child.pv.begin() + child.pv_length, ss.pv.begin() + 1);
+    ss.pv_length = child.pv_length + 1;
+}
+
+// Safety margin of delta pruning for positional gains of a capture
+const int DELTA_MARGIN = 200;
+
+int quisce(
+    NoisyBoard &board, 
+    int alpha, 
+    int beta, 
+    int ply,
+    SearchInfo &info
+)
+{
+    info.nodes++;
+    info.qnodes++;
+    info.stack[ply].pv_length = 0;
+    info.seldepth = std::max(info.seldepth, ply);
+
+    poll_stop(info);
+    if (should_stop(info)) {
+        return 0;
+    }
+
+    if (board.is_repetition(ply)) {
+        return 0;
+    }
+
+    // A draw by repetition is one move away, so the node is worth at least 0
+    if (alpha < 0 && board.has_game_cycle(ply)) {
+        alpha = 0;
+        if (alpha >= beta) {
+            return alpha;
+        }
+    }
+
+    if (ply >= MAX_PLY - 1) {
+        return board.inCheck() ? 0 : score(board, *info.eval_tables);
+    }
+
+    TTData entry;
+    Move hash_move = Move::NO_MOVE;
+    if (tt.probe(board.hash(), entry)) {
+        hash_move = entry.move;
+        int tt_score = score_from_tt(entry.score, ply);
+        if (tt_cutoff(entry, alpha, beta, tt_score)) {
+            return tt_score;
+        }
+    }
+
+    bool in_check = board.inCheck();
+
+    // In check there is no stand pat, every evasion gets searched
+    int best = in_check ? -MATE_VALUE + ply : score(board, *info.eval_tables);
+    info.stack[ply].static_eval = best;
+    if (best >= beta) {
+        return best;
+    }
+
+    // Whole-node delta pruning: not even winning a queen (and promoting a
+    // pawn if one is about to) would bring the score back to alpha
+    int stand_pat = best;
+    if (!in_check) {
+        int max_gain = pieceValue(PieceType::QUEEN);
+        if (pawn_on_seventh(board)) {
+            max_gain += pieceValue(PieceType::QUEEN) - pieceValue(PieceType::PAWN);
+        }
+        if (stand_pat + max_gain + DELTA_MARGIN < alpha) {
+            return stand_pat;
+        }
+    }
+
+    int old_alpha = alpha;
+    Move best_move = Move::NO_MOVE;
+
+    if (best > alpha) {
+        alpha = best;
+    }
+
+    MovePicker picker(board, hash_move, info, ply, true);
+    Move move;
+
+    while ((move = picker.next()) != Move::NO_MOVE) {
+        // Per-move delta pruning: the material this move wins is too little
+        if (!in_check && stand_pat + capture_gain(board, move) + DELTA_MARGIN <= alpha) {
+            continue;
+        }
+
+        info.stack[ply].current_move = move;
+        board.makeMove(move);
+        int score = -quisce(board, -beta, -alpha, ply + 1, info);
+        board.unmakeMove(move);
+        
+        if (should_stop(info)) {
+            return 0;
+        }
+        if (score >= beta) {
+            tt.store(board.hash(), move, score_to_tt(score, ply), 0, Bound::LOWER);
+            return score;
+        }
+        if (score > best) {
+            best = score;
+            if (score > alpha) {
+                alpha = score;
+                best_move = move;
+                update_pv(info, ply, move);
+            }
+        }        
+    }
+
+    tt.store(board.hash(), best_move, score_to_tt(best, ply), 0,
+             alpha > old_alpha ? Bound::EXACT : Bound::UPPER);
+
+    return best;
+}
+
+// Late move reductions indexed by [depth][moves searched], filled by
+// init_reductions() at startup
+const int LMR_MIN_DEPTH = 3;
+const int LMR_MIN_MOVES = 3;
+std::array<std::array<int, 64>, MAX_DEPTH + 1> reductions{};
+
+void init_reductions() {
+    for (int depth = 1; depth <= MAX_DEPTH; depth++) {
+        for (int moves = 1; moves < 64; moves++) {
+            reductions[depth][moves] = static_cast<int>(0.75 + std::log(depth) * std::log(moves) / 2.25);
+        }
+    }
+}
+
+// Forward pruning margins and depth limits
+const int RFP_MAX_DEPTH = 6;
+const int RFP_MARGIN = 80;
+const int RAZOR_MAX_DEPTH = 2;
+const int RAZOR_MARGIN = 250;
+const int FUTILITY_MAX_DEPTH = 5;
+const int FUTILITY_MARGIN = 100;
+const int LMP_MAX_DEPTH = 4;
+
+int negamax(
+    NoisyBoard &board, 
+    int alpha, 
+    int beta,
+    int depth, 
+    int ply, 
+    SearchInfo &info
+)
+{
+    if (depth <= 0) {
+        return quisce(board, alpha, beta, ply, info);
+    }
+
+    SearchStack &ss = info.stack[ply];
+    info.nodes++;
+    ss.pv_length = 0;
+    info.seldepth = std::max(info.seldepth, ply);
+
+    poll_stop(info);
+    if (should_stop(info)) {
+        return 0;
+    }
+
+    if (ply > 0) {
+        if (board.is_repetition(ply)) {
+            return 0;
+        }
+
+        // A draw by repetition is one move away, so the node is worth at least 0
+        if (alpha < 0 && board.has_game_cycle(ply)) {
+            alpha = 0;
+            if (alpha >= beta) {
+                return alpha;
+            }
+        }
+    }
+
+    bool in_check = board.inCheck();
+    if (ply >= MAX_PLY - 1) {
+        return in_check ? 0 : score(board, *info.eval_tables);
+    }
+
+    // A search excluding a move must neither use nor overwrite the full
+    // search's entry of the same position
+    bool excluding = ss.excluded_move != Move::NO_MOVE;
+
+    TTData entry;
+    Move hash_move = Move::NO_MOVE;
+    if (!excluding && tt.probe(board.hash(), entry)) {
+        hash_move = entry.move;
+        int tt_score = score_from_tt(entry.score, ply);
+        if (ply > 0 && entry.depth >= depth && tt_cutoff(entry, alpha, beta, tt_score)) {
+            return tt_score;
+        }
+    }
+
+    // The tables ignore the 50-move rule. Right after a zeroing move the
+    // result is exact and cheap to trust, so such positions are probed even
+    // below the probe depth. A result that cannot cut bounds the score of
+    // the search below instead.
+    int tb_min = -MATE_VALUE;
+    int tb_max = MATE_VALUE;
+    if (ply > 0 && !excluding && tablebases.largest() > 0) {
+        int pieces = board.occ().count();
+        tb::Wdl wdl;
+        if (pieces <= tablebases.largest()
+            && (pieces < tablebases.largest() || depth >= tb_probe_depth || board.halfMoveClock() == 0)
+            && tablebases.probe_wdl(board, wdl)) {
+            info.tbhits++;
+            int tb_score = wdl == tb::WIN ? TB_WIN - ply : wdl == tb::LOSS ? -TB_WIN + ply : 0;
+            Bound bound = wdl == tb::WIN ? Bound::LOWER : wdl == tb::LOSS ? Bound::UPPER : Bound::EXACT;
+            if (bound == Bound::EXACT || (bound == Bound::LOWER && tb_score >= beta)
+                || (bound == Bound::UPPER && tb_score <= alpha)) {
+                tt.store(board.hash(), Move::NO_MOVE, score_to_tt(tb_score, ply), std::min(depth + 6, MAX_DEPTH - 1),
+                         bound);
+                return tb_score;
+            }
+            (bound == Bound::LOWER ? tb_min : tb_max) = tb_score;
+        }
+    }
+
+    bool pv_node = beta - alpha > 1;
+    int static_eval = in_check ? -MATE_VALUE + ply : score(board, *info.eval_tables);
+    ss.static_eval = static_eval;
+
+    if (!pv_node && !in_check && !excluding && std::abs(beta) < MATE_BOUND) {
+        // Reverse futility: far enough above beta that no quiet reply should matter
+        if (depth <= RFP_MAX_DEPTH && static_eval - RFP_MARGIN * depth >= beta) {
+            return static_eval;
+        }
+
+        // Razoring: hopelessly below alpha, let the quiescence search confirm it
+        if (depth <= RAZOR_MAX_DEPTH && static_eval + RAZOR_MARGIN * depth < alpha) {
+            int razor_score = quisce(board, alpha - 1, alpha, ply, info);
+            if (razor_score < alpha) {
+                return razor_score;
+            }
+        }
+    }
+
+    if (depth > 3 
+        && !in_check 
+        && !excluding
+        && is_null_move_allowed(board)
+        && static_eval >= beta
+    ){
+        ss.current_move = Move(Move::NULL_MOVE);
+        board.makeNullMove();
+        int score = -negamax(board, -beta, -beta + 1, depth - 3, ply + 1, info);
+        board.unmakeNullMove();
+
+        if (should_stop(info)) {
+            return 0;
+        }
+        if (score >= beta) {
+            return score;
+        }
+    };
+
+    int old_alpha = alpha;
+    int best_value = -MATE_VALUE;
+    Move best_move = Move::NO_MOVE;
+
+    MovePicker picker(board, hash_move, info, ply);
+    Movelist quiets_tried;
+    int moves_searched = 0;
+    bool prune_quiets = !pv_node && !in_check;
+    Move move;
+
+    while ((move = picker.next()) != Move::NO_MOVE) {
+        if (move == ss.excluded_move
+            || (ply == 0 && !info.root_moves.empty() && std::find(info.root_moves.begin(), info.root_moves.end(), move) == info.root_moves.end())) {
+            continue;
+        }
+        bool quiet = is_quiet(board, move);
+
+        // Late move pruning: past a depth dependent move count the remaining
+        // quiets are ordered too badly to be worth a search
+        if (prune_quiets && quiet && depth <= LMP_MAX_DEPTH && moves_searched >= 3 + depth * depth
+            && best_value > -MATE_BOUND) {
+            continue;
+        }
+
+        ss.current_move = move;
+        board.makeMove(move);
+
+        // Futility pruning: a quiet move that does not give check cannot lift
+        // a static eval this far below alpha
+        if (prune_quiets && quiet && depth <= FUTILITY_MAX_DEPTH && moves_searched > 0
+            && best_value > -MATE_BOUND && static_eval + FUTILITY_MARGIN * (depth + 1) <= alpha
+            && !board.inCheck()) {
+            board.unmakeMove(move);
+            continue;
+        }
+
+        int score;
+        if (moves_searched == 0) {
+            score = -negamax(board, -beta, -alpha, depth - 1, ply + 1, info);
+        } else {
+            // Late quiet moves rarely raise alpha, search them shallower first
+            int reduction = 0;
+            if (depth >= LMR_MIN_DEPTH && moves_searched >= LMR_MIN_MOVES
+                && quiet && !in_check && !board.inCheck()) {
+                reduction = reductions[depth][std::min(moves_searched, 63)];
+                if (move == ss.killers[0] || move == ss.killers[1]) {
+                    reduction--;
+                }
+                reduction = std::clamp(reduction, 0, depth - 2);
+            }
+
+            // Principal variation search: prove the move is worse with a null
+            // window and only re-search with the full window when it is not
+            score = -negamax(board, -alpha - 1, -alpha, depth - 1 - reduction, ply + 1, info);
+            if (reduction > 0 && score > alpha) {
+                score = -negamax(board, -alpha - 1, -alpha, depth - 1, ply + 1, info);
+            }
+            if (score > alpha && score < beta) {
+                score = -negamax(board, -beta, -alpha, depth - 1, ply + 1, info);
+            }
+        }
+        board.unmakeMove(move);
+        moves_searched++;
+
+        if (should_stop(info)) {
+            return 0;
+        }
+        if (score >= beta) {
+            if (quiet) {
+                update_quiet_stats(info, board, ply, depth, move, quiets_tried);
+            }
+            update_pv(info, ply, move);
+            if (!excluding) {
+                tt.store(board.hash(), move, score_to_tt(score, ply), depth, Bound::LOWER);
+            }
+            return score;
+        }
+        if (quiet) {
+            quiets_tried.add(move);
+        }
+        if (score > best_value) {
+            best_value = score;
+            if (score > alpha) {
+                alpha = score;
+                best_move = move;
+                update_pv(info, ply, move);
+            }
+        }
+    }
+
+    if (moves_searched == 0) {
+        if (excluding) {
+            return alpha;
+        }
+        return in_check ? -MATE_VALUE + ply : 0;
+    }
+
+    best_value = std::clamp(best_value, tb_min, tb_max);
+    if (!excluding) {
+        tt.store(board.hash(), best_move, score_to_tt(best_value, ply), depth,
+                 best_value > old_alpha ? Bound::EXACT : Bound::UPPER);
+    }
+
+    return best_value;
+}
+
+// Time reserved per move for GUI and network latency
+const int MOVE_OVERHEAD = 20;
+
+// Splits the clock into an optimum time, checked between iterations, and a
+// maximum time that aborts a running iteration through poll_stop(). The
+// optimum is stretched while the best move keeps changing or the score is
+// dropping, and shrunk while both are stable.
+class TimeManager {
+public:
+    TimeManager(const SearchLimits &limits, Color us) {
+        int time = us == Color::WHITE ? limits.wtime : limits.btime;
+        int inc = us == Color::WHITE ? limits.winc : limits.binc;
+
+        if (limits.infinite) {
+            return;
+        }
+
+        if (limits.movetime > 0) {
+            enabled = true;
+            optimum = maximum = std::max(1, limits.movetime - MOVE_OVERHEAD);
+            fixed = true;
+            return;
+        }
+
+        if (time == 0 && inc == 0) {
+            return;
+        }
+
+        enabled = true;
+        int time_left = std::max(1, time - MOVE_OVERHEAD);
+        int moves_to_go = limits.movestogo > 0 ? std::min(limits.movestogo, 40) : 40;
+
+        maximum = std::min(time_left * 3 / 4, (time_left / moves_to_go + inc) * 5);
+        optimum = std::min(maximum, time_left / moves_to_go + inc * 3 / 4);
+        maximum = std::max(maximum, 1);
+        optimum = std::max(optimum, 1);
+    }
+
+    bool has_limit() const {
+        return enabled;
+    }
+
+    std::chrono::milliseconds maximum_time() const {
+        return std::chrono::milliseconds(maximum);
+    }
+
+    // Called by the main thread after every completed iteration
+    bool stop_after_iteration(std::chrono::milliseconds elapsed, Move best_move, int score) {
+        if (!enabled || fixed) {
+            return false;
+        }
+
+        best_move_changes *= 0.5;
+        if (iterations > 0 && best_move != last_best_move) {
+            best_move_changes += 1.0;
+        }
+
+        double instability = 0.75 + best_move_changes;
+        double falling = 1.0;
+        if (iterations > 0 && score < last_score) {
+            falling = std::min(2.0, 1.0 + (last_score - score) / 100.0);
+        }
+
+        last_best_move = best_move;
+        last_score = score;
+        iterations++;
+
+        double scaled = optimum * std::min(instability * falling, 3.0);
+        return elapsed.count() >= std::min<double>(scaled, maximum);
+    }
+
+private:
+    bool enabled = false;
+    bool fixed = false;
+    int optimum = 0;
+    int maximum = 0;
+
+    int iterations = 0;
+    Move last_best_move = Move::NO_MOVE;
+    int last_score = 0;
+    double best_move_changes = 0.0;
+};
+
+// Lazy SMP: every thread runs its own iterative deepening on a private copy
+// of the board with its own killers and history, and the threads only
+// cooperate through the shared transposition table.
+struct SearchThread {
+    explicit SearchThread(int id, const NoisyBoard &board) : id(id), board(board) {}
+
+    int id;
+    NoisyBoard board;
+    SearchInfo info;
+    Move best_move = Move::NO_MOVE;
+    int best_score = -MATE_VALUE;
+    int completed_depth = 0;
+    // PV of the last completed iteration
+    std::array<Move, MAX_PLY> pv{};
+    int pv_length = 0;
+    // Node count of the last completed iteration, readable by the main thread
+    std::atomic<long long> published_nodes{0};
+    std::atomic<long long> published_tbhits{0};
+};
+
+int thread_count = 1;
+
+// Helper threads skip some depths so they do not all search the same
+// iteration in lockstep with the main thread.
+static constexpr int SKIP_SIZE[] = {1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 4, 4, 4, 4, 4, 4, 4, 4};
+static constexpr int SKIP_PHASE[] = {0, 1, 0, 1, 2, 3, 0, 1, 2, 3, 4, 5, 0, 1, 2, 3, 4, 5, 6, 7};
+
+inline bool skip_depth(int thread_id, int depth) {
+    if (thread_id == 0) {
+        return false;
+    }
+    int i = (thread_id - 1) % 20;
+    return ((depth + SKIP_PHASE[i]) / SKIP_SIZE[i]) % 2 != 0;
+}
+
+// Score in UCI notation, "mate N" in moves rather than plies for mate scores
+std::string uci_score(int score) {
+    if (score >= MATE_BOUND) {
+        return "mate " + std::to_string((MATE_VALUE - score + 1) / 2);
+    }
+    if (score <= -MATE_BOUND) {
+        return "mate " + std::to_string(-(MATE_VALUE + score) / 2);
+    }
+    return "cp " + std::to_string(score);
+}
+
+const int ASPIRATION_MIN_DEPTH = 4;
+const int ASPIRATION_DELTA = 25;
+
+void iterative_deepening(SearchThread &thread, std::vector<std::unique_ptr<SearchThread>> &threads,
+                         const SearchLimits &limits, TimeManager &time_manager) {
+    SearchInfo &info = thread.info;
+    bool is_main = thread.id == 0;
+    int depth_limit = std::min(limits.depth, MAX_DEPTH - 1);
+
+    for (int depth = 1; depth <= depth_limit; depth++) {
+        if (skip_depth(thread.id, depth)) {
+            continue;
+        }
+
+        info.seldepth = 0;
+
+        // Aspiration window around the previous score, widened on every fail
+        int delta = ASPIRATION_DELTA;
+        int alpha = -MATE_VALUE;
+        int beta = MATE_VALUE;
+        if (depth >= ASPIRATION_MIN_DEPTH && std::abs(thread.best_score) < MATE_BOUND) {
+            alpha = std::max(thread.best_score - delta, -MATE_VALUE);
+            beta = std::min(thread.best_score + delta, MATE_VALUE);
+        }
+
+        int score;
+        while (true) {
+            score = negamax(thread.board, alpha, beta, depth, 0, info);
+            if (should_stop(info)) {
+                break;
+            }
+
+            if (score <= alpha && alpha > -MATE_VALUE) {
+                beta = (alpha + beta) / 2;
+                alpha = std::max(score - delta, -MATE_VALUE);
+            } else if (score >= beta && beta < MATE_VALUE) {
+                beta = std::min(score + delta, MATE_VALUE);
+            } else {
+                break;
+            }
+            delta += delta / 2;
+        }
+        if (should_stop(info)) {
+            break;
+        }
+
+        const SearchStack &root = info.stack[0];
+        std::copy(root.pv.begin(), root.pv.begin() + root.pv_length, thread.pv.begin());
+        thread.pv_length = root.pv_length;
+        thread.best_move = root.pv_length > 0 ? root.pv[0] : Move(Move::NO_MOVE);
+        thread.best_score = score;
+        thread.completed_depth = depth;
+        thread.published_nodes.store(info.nodes, std::memory_order_relaxed);
+        thread.published_tbhits.store(info.tbhits, std::memory_order_relaxed);
+
+        if (is_main) {
+            long long nodes = 0;
+            long long tbhits = 0;
+            for (const auto &t : threads) {
+                nodes += t->published_nodes.load(std::memory_order_relaxed);
+                tbhits += t->published_tbhits.load(std::memory_order_relaxed);
+            }
+
+            auto duration = get_duration(info.start);
+            auto nps = nodes * 1000 / std::max<long long>(duration.count(), 1);
+
+            std::lock_guard<std::mutex> lock(cout_mutex);
+            std::cout << "info depth " << depth << " seldepth " << info.seldepth
+                      << " score " << uci_score(score) << " time " << duration.count()
+                      << " nodes " << nodes << " nps " << nps << " hashfull " << tt.hashfull() << " tbhits " << tbhits
+                      << " pv";
+            for (int i = 0; i < thread.pv_length; i++) {
+                std::cout << " " << uci::moveToUci(thread.pv[i]);
+            }
+            std::cout << std::endl;
+        }
+
+        if (is_main) {
+            // A mate within the requested number of moves ends "go mate"
+            if (limits.mate > 0 && score >= MATE_VALUE - 2 * limits.mate) {
+                break;
+            }
+            if (!pondering.load(std::memory_order_relaxed)
+                && time_manager.stop_after_iteration(get_duration(info.start), thread.best_move, score)) {
+                break;
+            }
+        }
+    }
+
+    if (is_main) {
+        // In infinite and ponder mode bestmove may only be sent after stop or ponderhit
+        while (!stop_search.load(std::memory_order_relaxed)
+               && (limits.infinite || pondering.load(std::memory_order_relaxed))) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        // Once the main thread is done the helpers have nothing left to contribute
+        stop_search.store(true, std::memory_order_relaxed);
+    }
+}
+
+// Each thread votes for its best move, weighted by its completed depth and
+// by how much better its score is than the worst thread's.
+SearchThread &pick_best_thread(std::vector<std::unique_ptr<SearchThread>> &threads) {
+    SearchThread *best = threads[0].get();
+    if (threads.size() == 1) {
+        return *best;
+    }
+
+    int min_score = MATE_VALUE;
+    for (const auto &t : threads) {
+        if (t->completed_depth > 0) {
+            min_score = std::min(min_score, t->best_score);
+        }
+    }
+
+    std::unordered_map<uint16_t, long long> votes;
+    for (const auto &t : threads) {
+        if (t->completed_depth > 0) {
+            votes[t->best_move.move()] += static_cast<long long>(t->best_score - min_score + 14) * t->completed_depth;
+        }
+    }
+
+    for (const auto &t : threads) {
+        if (t->completed_depth == 0) {
+            continue;
+        }
+        if (best->completed_depth == 0
+            || votes[t->best_move.move()] > votes[best->best_move.move()]
+            || (votes[t->best_move.move()] == votes[best->best_move.move()] && t->best_score > best->best_score)) {
+            best = t.get();
+        }
+    }
+    return *best;
+}
+
+// Searches until the limits are reached or stop_search is raised. The
+// caller clears stop_search beforehand. On return info holds the main
+// thread's state with node counts summed over all threads, and the PV of
+// the chosen thread in stack[0].
+chess::Move noisy_boy(NoisyBoard &board, SearchInfo &info, const SearchLimits &limits) {
+    auto start = std::chrono::high_resolution_clock::now();
+    TimeManager time_manager(limits, board.sideToMove());
+
+    SearchInfo base = SearchInfo();
+    base.nodes = 0;
+    base.start = start;
+    // Every thread counts its own nodes, so each gets an equal share of the budget
+    base.max_nodes = limits.nodes ? std::max<long long>(limits.nodes / thread_count, 1) : 0;
+    if (base.max_nodes) {
+        base.polls_left = static_cast<int>(std::min<long long>(TIME_CHECK_INTERVAL, base.max_nodes));
+    }
+
+    // In a tablebase position only the moves keeping the best result are searched
+    if (board.occ().count() <= tablebases.largest()) {
+        Movelist moves;
+        movegen::legalmoves(moves, board);
+        if (tablebases.probe_root(board, moves)) {
+            base.root_moves = moves;
+            base.tbhits = moves.size();
+        }
+    }
+
+    if (time_manager.has_limit()) {
+        base.max_time = start + time_manager.maximum_time();
+    } else {
+        base.max_time = std::chrono::time_point<std::chrono::high_resolution_clock>::max();
+    }
+
+    tt.newSearch();
+
+    while (static_cast<int>(eval_tables.size()) < thread_count) {
+        eval_tables.push_back(std::make_unique<EvalTables>());
+    }
+    // The statistics reported at the end cover this search only
+    for (auto &tables : eval_tables) {
+        tables->clear_stats();
+    }
+
+    std::vector<std::unique_ptr<SearchThread>> threads;
+    for (int i = 0; i < thread_count; i++) {
+        threads.push_back(std::make_unique<SearchThread>(i, board));
+        threads.back()->info = base;
+        threads.back()->info.eval_tables = eval_tables[i].get();
+    }
+
+    std::vector<std::thread> helpers;
+    for (int i = 1; i < thread_count; i++) {
+        helpers.emplace_back(iterative_deepening, std::ref(*threads[i]), std::ref(threads), std::cref(limits),
+                             std::ref(time_manager));
+    }
+    iterative_deepening(*threads[0], threads, limits, time_manager);
+    for (auto &helper : helpers) {
+        helper.join();
+    }
+
+    SearchThread &best = pick_best_thread(threads);
+
+    info = threads[0]->info;
+    info.nodes = 0;
+    info.qnodes = 0;
+    info.tbhits = 0;
+    for (const auto &t : threads) {
+        info.nodes += t->info.nodes;
+        info.qnodes += t->info.qnodes;
+        info.tbhits += t->info.tbhits;
+    }
+    std::copy(best.pv.begin(), best.pv.begin() + best.pv_length, info.stack[0].pv.begin());
+    info.stack[0].pv_length = best.pv_length;
+
+    {
+        std::lock_guard<std::mutex> lock(cout_mutex);
+        std::cout << "info string " << cache_stats(eval_tables).str() << std::endl;
+    }
+
+    // Stopped before the first iteration completed, e.g. by "go nodes 1"
+    if (best.best_move == Move::NO_MOVE) {
+        Movelist moves = base.root_moves;
+        if (moves.empty()) {
+            movegen::legalmoves(moves, board);
+        }
+        if (!moves.empty()) {
+            return moves[0];
+        }
+    }
+
+    return best.best_move;
+}
+
+static const std::array<const char*, 12> BENCH_FENS{{
+    "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1",
+    "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1",
+    "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1",
+    "r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1",
+    "rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8",
+    "r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w - - 0 10",
+    "r1bqkb1r/pppp1ppp/2n2n2/4p3/2B1P3/5N2/PPPP1PPP/RNBQK2R w KQkq - 4 4",
+    "r2q1rk1/pp2bppp/2n1pn2/3p4/2PP4/2N2N2/PP2BPPP/R2Q1RK1 w - - 0 10",
+    "2r3k1/pp3ppp/4p3/3p4/3P4/2P1P3/PP3PPP/2R3K1 w - - 0 25",
+    "8/8/4k3/3p4/3P4/4K3/8/8 w - - 0 50",
+    "6k1/5ppp/8/8/8/8/5PPP/R5K1 w - - 0 1",
+    "r1b2rk1/2q1bppp/p2ppn2/1p6/3BPP2/2N2B2/PPPQ2PP/R4R1K b - - 0 14",
+}};
+
+void bench_eval(int iterations) {
+    std::vector<NoisyBoard> boards;
+    std::vector<Movelist> moves;
+    for (const auto &fen : BENCH_FENS) {
+        boards.emplace_back(fen);
+        moves.emplace_back();
+        movegen::legalmoves(moves.back(), boards.back());
+    }
+
+    std::vector<std::unique_ptr<EvalTables>> tables;
+    tables.push_back(std::make_unique<EvalTables>());
+    long long evals = 0;
+    long long checksum = 0;
+    auto start = std::chrono::high_resolution_clock::now();
 
-inline std::vector<int> mirrorTable(const std::vector<int>& original) {
-    if (original.size() != 64) {
-        throw std::invalid_argument("mirrorTable() error: input vector size != 64");
-    }
-    std::vector<int> mirrored(64);
-    for (int row = 0; row < 8; ++row) {
-        for (int col = 0; col < 8; ++col) {
-            int srcIndex = row * 8 + col;
-            int destIndex = (7 - row) * 8 + col;
-            mirrored[destIndex] = original[srcIndex];
-        }
-    }
-    return mirrored;
-}
-
-struct PieceTable {
-    std::unordered_map<std::string, std::vector<int>> tables;
-
-    PieceTable() {
-        // Pawn table
-        tables["p"] = {
-            0, 0, 0, 0, 0, 0, 0, 0,
-            5, 10, 10, -40, -40, 10, 10, 5,
-            5, -5, -10, 0, 0, -10, -5, 5,
-            0, 0, 0, 50, 50, 0, 0, 0,
-            5, 5, 10, 25, 25, 10, 5, 5,
-            10, 10, 20, 30, 30, 20, 10, 10,
-            50, 50, 50, 50, 50, 50, 50, 50,
-            0, 0, 0, 0, 0, 0, 0, 0
-        };
-
-        // Knight table
-        tables["n"] = {
-            -50, -40, -30, -30, -30, -30, -40, -50,
-            -40, -20, 0, 5, 5, 0, -20, -40,
-            -30, 5, 10, 15, 15, 10, 5, -30,
-            -30, 0, 15, 20, 20, 15, 0, -30,
-            -30, 5, 15, 20, 20, 15, 5, -30,
-            -30, 0, 10, 15, 15, 10, 0, -30,
-            -40, -20, 0, 0, 0, 0, -20, -40,
-            -50, -40, -30, -30, -30, -30, -40, -50
-        };
-
-        // Bishop table
-        tables["b"] = {
-            -20, -10, -40, -10, -10, -40, -10, -20,
-            -10, 5, 0, 0, 0, 0, 5, -10,
-            -10, 10, 10, 10, 10, 10, 10, -10,
-            -10, 0, 20, 10, 10, 20, 0, -10,
-            -10, 5, 5, 10, 10, 5, 5, -10,
-            -10, 0, 5, 10, 10, 5, 0, -10,
-            -10, 0, 0, 0, 0, 0, 0, -10,
-            -20, -10, -40, -10, -10, -40, -10, -20
-        };
-
-        // Rook table
-        tables["r"] = {
-            0, 0, 0, 5, 5, 0, 0, 0,
-            -5, 0, 0, 0, 0, 0, 0, -5,
-            -5, 0, 0, 0, 0, 0, 0, -5,
-            -5, 0, 0, 0, 0, 0, 0, -5,
-            -5, 0, 0, 0, 0, 0, 0, -5,
-            -5, 0, 0, 0, 0, 0, 0, -5,
-            5, 10, 10, 10, 10, 10, 10, 5,
-            0, 0, 0, 0, 0, 0, 0, 0
-        };
-
-        // Queen table
-        tables["q"] = {
-            -20, -10, -10, -5, -5, -10, -10, -20,
-            -10, 0, 0, 0, 0, 0, 0, -10,
-            -10, 5, 5, 5, 5, 5, 0, -10,
-            0, 0, 5, 5, 5, 5, 0, -5,
-            -5, 0, 5, 5, 5, 5, 0, -5,
-            -10, 0, 5, 5, 5, 5, 0, -10,
-            -10, 0, 0, 0, 0, 0, 0, -10,
-            -20, -10, -10, -5, -5, -10, -10, -20
-        };
-
-        // King table
-        tables["k"] = {
-            20, 30, 10, 0, 0, 10, 30, 20,
-            20, 20, -10, -10, -10, -10, 20, 20,
-            -10, -20, -20, -20, -20, -20, -20, -10,
-            -20, -30, -30, -40, -40, -30, -30, -20,
-            -30, -40, -40, -50, -50, -40, -40, -30,
-            -30, -40, -40, -50, -50, -40, -40, -30,
-            -30, -40, -40, -50, -50, -40, -40, -30,
-            -30, -40, -40, -50, -50, -40, -40, -30
-        };
-        tables["P"] = mirrorTable(tables["p"]);
-        tables["N"] = mirrorTable(tables["n"]);
-        tables["B"] = mirrorTable(tables["b"]);
-        tables["R"] = mirrorTable(tables["r"]);
-        tables["Q"] = mirrorTable(tables["q"]);
-        tables["K"] = mirrorTable(tables["k"]);
-
-    }
-};
-
-int pieceSquaresVal(Bitboard piece, const std::string &type) {
-    int score = 0;
-    static const PieceTable pieceTable;
-
-    auto it = pieceTable.tables.find(type);
-    if (it == pieceTable.tables.end()) {
-        throw std::invalid_argument("Invalid piece type: " + type);
+    // Evaluate every child of each position, so the cost of keeping
+    // incremental state up to date in make/unmake is part of the measurement.
+    // The same positions come back every iteration, so the eval cache is
+    // bypassed.
+    for (int i = 0; i < iterations; i++) {
+        for (size_t b = 0; b < boards.size(); b++) {
+            for (const auto &move : moves[b]) {
+                boards[b].makeMove(move);
+                checksum += evaluate(boards[b], *tables[0]);
+                boards[b].unmakeMove(move);
+                evals++;
+            }
+        }
     }
-    
-    const std::vector<int>& table = it->second;
 
-    for (Bitboard bb = piece; bb; bb &= (bb.getBits() - 1)) {
-        int square = __builtin_ctzll(bb.getBits());
-        score += table[square];
-    }
-    return score;
-}
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::high_resolution_clock::now() - start).count();
 
-struct PieceInfo {
-    chess::PieceType type;
-    int materialValue;
-    const char* whiteKey;  
-    const char* blackKey;
-};
+    std::cout << "evals " << evals << " time " << elapsed / 1000 << "ms"
+              << " evals/s " << evals * 1000000 / (elapsed + 1)
+              << " checksum " << checksum << std::endl;
+    std::cout << cache_stats(tables).str() << std::endl;
+}
 
-struct SearchInfo {
-    std::vector<Move> pv;
-    long long nodes;
-    std::chrono::time_point<std::chrono::high_resolution_clock> max_time;
-    std::chrono::time_point<std::chrono::high_resolution_clock> start;
+struct SeeTest {
+    const char *fen;
+    const char *move;
+    int value;
 };
 
-static constexpr std::array<PieceInfo, 5> pieceInfos{{
-    { chess::PieceType::PAWN,   100, "p", "P" },
-    { chess::PieceType::KNIGHT, 300, "n", "N" },
-    { chess::PieceType::BISHOP, 300, "b", "B" },
-    { chess::PieceType::ROOK,   500, "r", "R" },
-    { chess::PieceType::QUEEN,  900, "q", "Q" }
+// Known exchange values with the engine's piece values (P=100, N=B=300,
+// R=500, Q=900)
+static const std::array<SeeTest, 15> SEE_TESTS{{
+    {"1k1r4/1pp4p/p7/4p3/8/P5P1/1PP4P/2K1R3 w - - 0 1", "e1e5", 100},
+    {"1k1r3q/1ppn3p/p4b2/4p3/8/P2N2P1/1PP1R1BP/2K1Q3 w - - 0 1", "d3e5", -200},
+    {"6k1/1pp4p/p1pb4/6q1/3P1pRr/2P4P/PP1Br1P1/5RKN w - - 0 1", "f1f4", -100},
+    {"4R3/2r3p1/5bk1/1p1r3p/p2PR1P1/P1BK1P2/1P6/8 b - - 0 1", "h5g4", 0},
+    {"4k3/8/8/3p4/4P3/8/8/4K3 w - - 0 1", "e4d5", 100},
+    {"4k3/8/2p5/3p4/4P3/8/8/4K3 w - - 0 1", "e4d5", 0},
+    {"4k3/8/5n2/3p4/8/8/3Q4/4K3 w - - 0 1", "d2d5", -800},
+    {"4k3/3r4/8/3p4/8/8/3R4/3RK3 w - - 0 1", "d2d5", 100},
+    {"3rk3/3r4/8/3p4/8/8/3R4/4K3 w - - 0 1", "d2d5", -400},
+    {"3r3k/8/8/3p4/2K5/8/8/3R4 w - - 0 1", "d1d5", 100},
+    {"3r3k/3r4/8/3p4/2K5/8/8/3R4 w - - 0 1", "d1d5", -400},
+    {"4k3/8/8/3pP3/8/8/8/4K3 w - d6 0 1", "e5d6", 100},
+    {"1n2k3/P7/8/8/8/8/8/4K3 w - - 0 1", "a7b8q", 1100},
+    {"1r2k3/P2n4/8/8/8/8/8/4K3 w - - 0 1", "a7b8q", 400},
+    {"4k3/8/8/4p3/8/8/2N5/4K3 w - - 0 1", "c2d4", -300},
 }};
 
-inline const char* getKey(const PieceInfo &info, Color side) {
-    return (side == Color::WHITE) ? info.whiteKey : info.blackKey;
+// Checks see() against SEE_TESTS: each move must reach its exact value and
+// fail one centipawn above it
+void bench_see() {
+    int passed = 0;
+    for (const auto &test : SEE_TESTS) {
+        Board board(test.fen);
+        Move move = uci::uciToMove(board, test.move);
+        if (see(board, move, test.value) && !see(board, move, test.value + 1)) {
+            passed++;
+        } else {
+            std::cout << "see failed: " << test.fen << " " << test.move
+                      << " expected " << test.value << std::endl;
+        }
+    }
+    std::cout << "see tests passed " << passed << "/" << SEE_TESTS.size() << std::endl;
 }
 
-inline bool is_endgame(Board &board) {
-    int queens = 0;
-    int minors = 0;
-    queens += board.pieces(PieceType::QUEEN).count();
-    minors += board.pieces(PieceType::KNIGHT).count();
-    minors += board.pieces(PieceType::BISHOP).count();
+struct EndgameTest {
+    const char *fen;
+    // Bounds of the evaluation, from white's point of view
+    int low;
+    int high;
+};
 
-    if (queens == 0 || (queens <= 2 && minors<=1)){
-        return true;
-    }
+// Scaling only applies to the endgame half of the score, so a drawn
+// endgame keeps a small middlegame share of the material
+const int DRAWISH = 50;
+
+// Endgames the material table has to recognise as won or drawn
+static const std::array<EndgameTest, 8> ENDGAME_TESTS{{
+    {"8/8/8/4k3/8/8/8/1NN1K3 w - - 0 1", -DRAWISH, DRAWISH},
+    {"8/8/8/4k3/8/8/8/1NN1K3 b - - 0 1", -DRAWISH, DRAWISH},
+    {"8/8/8/4k3/8/8/8/1N2K3 w - - 0 1", -DRAWISH, DRAWISH},
+    {"8/8/8/4k3/8/8/8/1B2K3 w - - 0 1", -DRAWISH, DRAWISH},
+    {"8/8/8/4k3/8/8/8/1NB1K3 w - - 0 1", KNOWN_WIN, EVAL_MAX},
+    {"8/8/8/4k3/8/8/8/1BB1K3 b - - 0 1", KNOWN_WIN, EVAL_MAX},
+    {"8/8/8/4k3/8/8/8/1R2K3 w - - 0 1", KNOWN_WIN, EVAL_MAX},
+    {"3qk3/8/8/8/8/8/8/4K3 w - - 0 1", -EVAL_MAX, -KNOWN_WIN},
+}};
 
-    return false;
+// Checks the hand-written evaluation, incremental and from scratch, of
+// ENDGAME_TESTS
+void bench_endgames() {
+    EvalTables tables;
+    int passed = 0;
+    for (const auto &test : ENDGAME_TESTS) {
+        NoisyBoard board(test.fen);
+        int sign = board.sideToMove() == Color::WHITE ? 1 : -1;
+        int incremental = sign * evaluate(board, tables);
+        int scratch = sign * score_from_scratch(board);
+        if (incremental >= test.low && incremental <= test.high && scratch == incremental) {
+            passed++;
+        } else {
+            std::cout << "endgame failed: " << test.fen << " evaluates to " << incremental << " (" << scratch
+                      << " from scratch), expected " << test.low << ".." << test.high << std::endl;
+        }
+    }
+    std::cout << "endgame tests passed " << passed << "/" << ENDGAME_TESTS.size() << std::endl;
 }
 
+// Fixed-depth search over the bench positions with a cleared hash table.
+// The total node count is a signature for the search tree shape (with a
+// single thread; Lazy SMP searches are not deterministic).
+void bench_search(int depth, int threads) {
+    int saved_threads = thread_count;
+    thread_count = threads;
+    long long nodes = 0;
+    long long qnodes = 0;
+    CacheStats stats;
+    auto start = std::chrono::high_resolution_clock::now();
 
-int score(Board &board) {
-    int totalScore = 0;
+    for (const auto &fen : BENCH_FENS) {
+        NoisyBoard board(fen);
+        SearchInfo info;
+        SearchLimits limits;
+        limits.depth = depth;
+        tt.clear();
+        stop_search.store(false, std::memory_order_relaxed);
+        noisy_boy(board, info, limits);
+        nodes += info.nodes;
+        qnodes += info.qnodes;
+        stats += cache_stats(eval_tables);
+    }
 
-    Color us = board.sideToMove();
-    Color them = ~us;
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::high_resolution_clock::now() - start).count();
 
-    for (const auto &info : pieceInfos) {
-        auto ourPieces = board.pieces(info.type, us);
-        auto theirPieces = board.pieces(info.type, them);
+    thread_count = saved_threads;
 
-        int ourPieceCount = ourPieces.count();
-        int theirPieceCount = theirPieces.count();
-        totalScore += ourPieceCount * info.materialValue;
-        totalScore -= theirPieceCount * info.materialValue;
+    std::cout << "bench depth " << depth << " threads " << threads << " nodes " << nodes << " qnodes " << qnodes
+              << " time " << elapsed << "ms" << " nps " << nodes * 1000 / (elapsed + 1) << std::endl;
+    std::cout << stats.str() << std::endl;
+}
 
-        totalScore += pieceSquaresVal(ourPieces, getKey(info, us));
-        totalScore -= pieceSquaresVal(theirPieces, getKey(info, them));
+// The move the engine expects in reply to best_move: the second move of the
+// PV, or the hash move after best_move when the PV is too short
+Move ponder_move(NoisyBoard &board, const SearchInfo &info, Move best_move) {
+    Move reply = Move::NO_MOVE;
+    if (best_move.move() == Move::NO_MOVE) {
+        return reply;
     }
 
-    auto ourKing = board.pieces(PieceType::KING, us);
-    auto theirKing = board.pieces(PieceType::KING, them);
-    totalScore += pieceSquaresVal(ourKing, getKey({PieceType::KING, 0, "k", "K"}, us));
-    totalScore -= pieceSquaresVal(theirKing, getKey({PieceType::KING, 0, "k", "K"}, them));
+    const SearchStack &root = info.stack[0];
+    if (root.pv_length > 1 && root.pv[0] == best_move) {
+        return root.pv[1];
+    }
 
-    return totalScore;
+    board.makeMove(best_move);
+    TTData entry;
+    if (tt.probe(board.hash(), entry) && is_legal_move(board, entry.move)) {
+        reply = entry.move;
+    }
+    board.unmakeMove(best_move);
+    return reply;
 }
 
-struct SearchTimeoutException : public std::exception {
-    const char* what() const noexcept override {
-        return "Search timeout";
-    }
+#if TUNE
+// Texel tuning of the weights in eval_params.hpp against game results.
+//
+// Positions are loaded once, kept as PackedBoards, and turned into sparse
+// feature vectors (the non-zero coefficients of EvalTrace) in a single
+// parallel pass. Every epoch then evaluates all positions from their
+// features alone: the evaluation is linear in the weights apart from the
+// phase and the endgame scale factor, which are stored per position. Adam
+// minimizes the mean squared error between the result and a sigmoid of
+// the evaluation, and the rounded weights are written back as a header.
+
+struct LabelledBoard {
+    PackedBoard board;
+    // From white's point of view: 1, 0.5 or 0
+    float result;
+};
+
+struct TuneFeature {
+    uint16_t index;
+    float coeff;
 };
 
-bool is_null_move_allowed(const Board &board) {
-    Color sideToMove = board.sideToMove();
+struct TunePosition {
+    float result;
+    uint8_t phase;
+    uint8_t scale;
+    uint32_t begin;
+    uint32_t end;
+};
 
-    Bitboard kingBitboard = board.pieces(PieceType::KING, sideToMove);
-    Bitboard pawnBitboard = board.pieces(PieceType::PAWN, sideToMove);
-    Bitboard allPiecesBitboard = board.us(sideToMove);
+struct TuneSet {
+    std::vector<TunePosition> positions;
+    std::vector<TuneFeature> features;
+};
 
-    if ((kingBitboard | pawnBitboard) == allPiecesBitboard) {
-        return false;
-    }
+// Middlegame and endgame half of every weight, indexed by term
+using TuneParams = std::vector<std::array<double, 2>>;
 
-    int totalPieces = board.all().count();
+struct ParamBlock {
+    const char *name;
+    const char *comment;
+    int offset;
+    int size;
+    const eval_params::Weight *values;
+};
 
-    return totalPieces > 6;
+static const std::array<ParamBlock, 14> PARAM_BLOCKS{{
+    {"MATERIAL", "Indexed by PieceType", term::MATERIAL, 5, eval_params::MATERIAL.data()},
+    {"PIECE_SQUARE", "Indexed by [PieceType][square]", term::PIECE_SQUARE, 6 * 64, eval_params::PIECE_SQUARE[0].data()},
+    {"DOUBLED_PAWN", "Pawn structure", term::DOUBLED_PAWN, 1, &eval_params::DOUBLED_PAWN},
+    {"ISOLATED_PAWN", nullptr, term::ISOLATED_PAWN, 1, &eval_params::ISOLATED_PAWN},
+    {"BACKWARD_PAWN", nullptr, term::BACKWARD_PAWN, 1, &eval_params::BACKWARD_PAWN},
+    {"PASSED_PAWN", "Passed pawns by relative rank", term::PASSED_PAWN, 8, eval_params::PASSED_PAWN.data()},
+    {"BISHOP_PAIR", "Material imbalance, the adjustments are per own pawn above five", term::BISHOP_PAIR, 1,
+     &eval_params::BISHOP_PAIR},
+    {"KNIGHT_PAWN_ADJUST", nullptr, term::KNIGHT_PAWN_ADJUST, 1, &eval_params::KNIGHT_PAWN_ADJUST},
+    {"ROOK_PAWN_ADJUST", nullptr, term::ROOK_PAWN_ADJUST, 1, &eval_params::ROOK_PAWN_ADJUST},
+    {"MOBILITY", "Per reachable square, indexed by PieceType", term::MOBILITY, 6, eval_params::MOBILITY.data()},
+    {"KING_ATTACK_WEIGHT", "Per piece attacking the enemy king zone, indexed by PieceType", term::KING_ATTACK_WEIGHT,
+     6, eval_params::KING_ATTACK_WEIGHT.data()},
+    {"THREAT_BY_PAWN", "Threats", term::THREAT_BY_PAWN, 1, &eval_params::THREAT_BY_PAWN},
+    {"THREAT_BY_MINOR", nullptr, term::THREAT_BY_MINOR, 1, &eval_params::THREAT_BY_MINOR},
+    {"HANGING_PIECE", nullptr, term::HANGING_PIECE, 1, &eval_params::HANGING_PIECE},
+}};
+
+TuneParams initial_params() {
+    TuneParams params(term::COUNT);
+    for (const auto &block : PARAM_BLOCKS) {
+        for (int i = 0; i < block.size; i++) {
+            params[block.offset + i] = {static_cast<double>(block.values[i].mg),
+                                        static_cast<double>(block.values[i].eg)};
+        }
+    }
+    return params;
 }
 
-bool should_stop(SearchInfo &info) {
-    auto current_time = std::chrono::high_resolution_clock::now();
-    return current_time > info.max_time;
+bool write_params(const TuneParams &params, const std::string &path) {
+    static constexpr const char *PIECE_NAMES[] = {"Pawn", "Knight", "Bishop", "Rook", "Queen", "King"};
+
+    auto weight = [&](int index) {
+        return "{" + std::to_string(static_cast<int>(std::lround(params[index][0]))) + ", "
+             + std::to_string(static_cast<int>(std::lround(params[index][1]))) + "}";
+    };
+    // Eight weights per line
+    auto rows = [&](std::ostream &out, int offset, int size, const std::string &indent) {
+        for (int i = 0; i < size; i++) {
+            out << (i % 8 == 0 ? indent : " ") << weight(offset + i)
+                << (i + 1 == size ? "\n" : i % 8 == 7 ? ",\n" : ",");
+        }
+    };
+
+    std::ofstream out(path);
+    out << "#pragma once\n\n"
+        << "// Evaluation weights of NoisyBoy as {middlegame, endgame} pairs, from\n"
+        << "// white's point of view. Piece-square tables start at a1.\n"
+        << "//\n"
+        << "// Written by the tuner (\"make tune\"), which overwrites any hand edits.\n\n"
+        << "#include <array>\n\n"
+        << "namespace eval_params {\n\n"
+        << "struct Weight {\n    int mg;\n    int eg;\n};\n";
+
+    for (const auto &block : PARAM_BLOCKS) {
+        out << (block.comment ? std::string("\n// ") + block.comment + "\n" : "");
+
+        if (block.offset == term::PIECE_SQUARE) {
+            out << "constexpr std::array<std::array<Weight, 64>, 6> " << block.name << "{{\n";
+            for (int pt = 0; pt < 6; pt++) {
+                out << "    // " << PIECE_NAMES[pt] << "\n    {{\n";
+                rows(out, block.offset + pt * 64, 64, "        ");
+                out << (pt < 5 ? "    }},\n" : "    }}\n");
+            }
+            out << "}};\n";
+        } else if (block.size == 1) {
+            out << "constexpr Weight " << block.name << weight(block.offset) << ";\n";
+        } else {
+            out << "constexpr std::array<Weight, " << block.size << "> " << block.name << "{{\n";
+            rows(out, block.offset, block.size, "    ");
+            out << "}};\n";
+        }
+    }
+
+    out << "\n}  // namespace eval_params\n";
+    return static_cast<bool>(out);
 }
 
-std::chrono::milliseconds get_duration(std::chrono::time_point<std::chrono::high_resolution_clock> start) {
-    auto current_time = std::chrono::high_resolution_clock::now();
-    return std::chrono::duration_cast<std::chrono::milliseconds>(current_time - start);
+// Game results as written in EPD and PGN files
+bool parse_result(std::string_view text, float &result) {
+    if (text.find("1/2-1/2") != std::string_view::npos || text.find("0.5") != std::string_view::npos) {
+        result = 0.5f;
+    } else if (text.find("1-0") != std::string_view::npos || text.find("1.0") != std::string_view::npos) {
+        result = 1.0f;
+    } else if (text.find("0-1") != std::string_view::npos || text.find("0.0") != std::string_view::npos) {
+        result = 0.0f;
+    } else {
+        return false;
+    }
+    return true;
 }
 
-int quisce(
-    Board &board, 
-    int alpha, 
-    int beta, 
-    int ply,
-    SearchInfo &info
-)
-{
-    info.nodes++;
+// One position per line: the FEN (the move counters may be missing)
+// followed by the result, e.g. c9 "1-0"; or [0.5]
+void load_epd(std::istream &in, std::vector<LabelledBoard> &out) {
+    std::string line;
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        std::vector<std::string> tokens;
+        for (std::string token; fields >> token;) {
+            tokens.push_back(token);
+        }
 
-    if (should_stop(info)) {
-        return 0;
-    }
+        std::string rest;
+        for (size_t i = 4; i < tokens.size(); i++) {
+            rest += " " + tokens[i];
+        }
+        float result;
+        if (tokens.size() < 5 || !parse_result(rest, result)) {
+            continue;
+        }
 
-    if (board.isRepetition()) {
-        return 0;
+        std::string fen = tokens[0] + " " + tokens[1] + " " + tokens[2] + " " + tokens[3];
+        bool counters = tokens.size() >= 6 && std::isdigit(static_cast<unsigned char>(tokens[4][0]))
+                     && std::isdigit(static_cast<unsigned char>(tokens[5][0]));
+        fen += counters ? " " + tokens[4] + " " + tokens[5] : " 0 1";
+        out.push_back({Board::Compact::encode(Board(fen)), result});
     }
+}
 
-    int best = score(board);
-    if (best >= beta) {
-        return best;
+// Takes every position of a finished game after the opening, except those
+// in check or right after a capture or promotion, which are not quiet
+class TuneVisitor : public pgn::Visitor {
+public:
+    explicit TuneVisitor(std::vector<LabelledBoard> &out) : out_(out) {}
+
+    void startPgn() override {
+        fen_ = std::string(constants::STARTPOS);
+        result_ = -1;
+        positions_.clear();
     }
 
-    if (best > alpha) {
-        alpha = best;
+    void header(std::string_view key, std::string_view value) override {
+        if (key == "FEN") {
+            fen_ = value;
+        } else if (key == "Result" && !parse_result(value, result_)) {
+            result_ = -1;
+        }
     }
 
-    Movelist moves;
-    movegen::legalmoves(moves, board);
+    void startMoves() override {
+        if (result_ < 0) {
+            skipPgn(true);
+            return;
+        }
+        board_.setFen(fen_);
+        ply_ = 0;
+    }
 
-    for (const auto& move : moves) {
-        if (!board.isCapture(move)) {
-            continue;
+    void move(std::string_view san, std::string_view) override {
+        Move move;
+        try {
+            move = uci::parseSan(board_, san);
+        } catch (const std::exception &) {
+            move = Move::NO_MOVE;
         }
-    
-        board.makeMove(move);
-        int score = -quisce(board, -beta, -alpha, ply + 1, info);
-        board.unmakeMove(move);
-        
-        if (should_stop(info)) {
-            return 0;
+        if (move.move() == Move::NO_MOVE) {
+            skipPgn(true);
+            return;
         }
-        if (score >= beta) {
-            return score;
+
+        bool noisy = board_.isCapture(move) || move.typeOf() == Move::PROMOTION;
+        board_.makeMove(move);
+        if (++ply_ >= OPENING_PLIES && !noisy && !board_.inCheck()) {
+            positions_.push_back(Board::Compact::encode(board_));
         }
-        if (score > best) {
-            best = score;
-            if (score > alpha) {
-                alpha = score;
-                info.pv[ply] = move;
+    }
+
+    void endPgn() override {
+        if (result_ >= 0) {
+            for (const auto &packed : positions_) {
+                out_.push_back({packed, result_});
             }
-        }        
+        }
+        positions_.clear();
     }
 
-    return best;
-}
+private:
+    static constexpr int OPENING_PLIES = 8;
 
-int negamax(
-    Board &board, 
-    int alpha, 
-    int beta,
-    int depth, 
-    int ply, 
-    SearchInfo &info
-)
-{
-    if (should_stop(info)) {
-        return 0;
-    }
+    std::vector<LabelledBoard> &out_;
+    std::vector<PackedBoard> positions_;
+    Board board_;
+    std::string fen_;
+    float result_ = -1;
+    int ply_ = 0;
+};
 
-    if (depth <= 0) {
-        return quisce(board, alpha, beta, ply, info);
+// White's evaluation of a position from its features and the given weights
+inline double tune_eval(const TuneSet &set, const TunePosition &pos, const TuneParams &params) {
+    double mg = 0;
+    double eg = 0;
+    for (uint32_t i = pos.begin; i < pos.end; i++) {
+        const TuneFeature &f = set.features[i];
+        mg += f.coeff * params[f.index][0];
+        eg += f.coeff * params[f.index][1];
     }
+    return (mg * pos.phase + eg * pos.scale / SCALE_NORMAL * (PHASE_MAX - pos.phase)) / PHASE_MAX;
+}
 
-    info.nodes++;
+inline double sigmoid(double k, double eval) {
+    return 1.0 / (1.0 + std::exp(-k * eval));
+}
 
-    if (board.isRepetition() && ply > 0) {
-        return 0;
+// Runs body(thread, begin, end) over [0, count) split evenly across threads
+template <typename Body>
+void parallel_for(size_t count, int threads, Body body) {
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back(body, t, count * t / threads, count * (t + 1) / threads);
+    }
+    for (auto &worker : workers) {
+        worker.join();
     }
+}
 
-    Movelist moves;
-    movegen::legalmoves(moves, board); 
+// Extracts the features of boards[begin, end). Positions that a specialized
+// endgame evaluator would score are left out. Also sums the difference to
+// the engine's own evaluation, which only rounding should cause.
+void extract_features(const std::vector<LabelledBoard> &boards, size_t begin, size_t end, const TuneParams &params,
+                      TuneSet &set, double &deviation) {
+    EvalTrace trace;
+    eval_trace = &trace;
+
+    for (size_t n = begin; n < end; n++) {
+        Board board = Board::Compact::decode(boards[n].board);
+        trace = EvalTrace();
+
+        std::array<uint8_t, 12> counts{};
+        for (int piece = 0; piece < 12; piece++) {
+            Piece p = Piece(static_cast<Piece::underlying>(piece));
+            counts[piece] = static_cast<uint8_t>(board.pieces(p.type(), p.color()).count());
+        }
+        MaterialEntry material = evaluate_material(counts);
+        if (material.endgame) {
+            continue;
+        }
+
+        for (Bitboard pieces = board.occ(); !pieces.empty();) {
+            Square sq = pieces.pop();
+            Piece piece = board.at(sq);
+            Color color = piece.color();
+            int type = static_cast<int>(piece.type());
+            int relative = color == Color::WHITE ? sq.index() : sq.index() ^ 56;
+            if (type < 5) {
+                TRACE(color, term::MATERIAL + type, 1);
+            }
+            TRACE(color, term::PIECE_SQUARE + type * 64 + relative, 1);
+        }
+        evaluate_pawns(board);
+        evaluate_attacks(board);
+
+        TunePosition pos;
+        pos.result = boards[n].result;
+        pos.phase = static_cast<uint8_t>(std::min(material.phase, PHASE_MAX));
+        pos.begin = static_cast<uint32_t>(set.features.size());
+        double eg = 0;
+        for (int i = 0; i < term::COUNT; i++) {
+            if (trace.coeffs[i] != 0) {
+                set.features.push_back({static_cast<uint16_t>(i), static_cast<float>(trace.coeffs[i])});
+                eg += trace.coeffs[i] * params[i][1];
+            }
+        }
+        pos.end = static_cast<uint32_t>(set.features.size());
+        pos.scale = material.scale[eg > 0 ? 0 : 1];
+        set.positions.push_back(pos);
 
-    if (moves.empty()) {
-        return board.inCheck() ? -MATE_VALUE + ply : 0;
+        int engine = score_from_scratch(board);
+        engine = board.sideToMove() == Color::WHITE ? engine : -engine;
+        deviation += std::abs(engine - tune_eval(set, pos, params));
     }
 
-    if (depth > 3 
-        && !board.inCheck() 
-        && is_null_move_allowed(board)
-        && (beta - score(board) > 200)
-    ){
-        board.makeNullMove();
-        int score = -negamax(board, -beta, -beta + 1, depth - 3, ply + 1, info);
-        board.unmakeNullMove();
+    eval_trace = nullptr;
+}
 
-        if (score >= beta) {
-            return score;
+double tune_error(const TuneSet &set, const TuneParams &params, double k, int threads) {
+    std::vector<double> sums(threads);
+    parallel_for(set.positions.size(), threads, [&](int t, size_t begin, size_t end) {
+        double sum = 0;
+        for (size_t i = begin; i < end; i++) {
+            double error = set.positions[i].result - sigmoid(k, tune_eval(set, set.positions[i], params));
+            sum += error * error;
         }
-    };
+        sums[t] = sum;
+    });
 
-    int best_value = -MATE_VALUE;
+    double total = 0;
+    for (double sum : sums) {
+        total += sum;
+    }
+    return total / std::max<size_t>(set.positions.size(), 1);
+}
 
-    for (const auto& move : moves) {
-        board.makeMove(move);
-        int score = -negamax(board, -beta, -alpha, depth - 1, ply + 1, info);
-        board.unmakeMove(move);
+// Scaling constant of the sigmoid that best fits the current weights
+double fit_k(const TuneSet &set, const TuneParams &params, int threads) {
+    double low = 0;
+    double high = 0.02;
+    const double ratio = (std::sqrt(5.0) - 1) / 2;
+    for (int i = 0; i < 40; i++) {
+        double a = high - ratio * (high - low);
+        double b = low + ratio * (high - low);
+        if (tune_error(set, params, a, threads) < tune_error(set, params, b, threads)) {
+            high = b;
+        } else {
+            low = a;
+        }
+    }
+    return (low + high) / 2;
+}
 
-        if (should_stop(info)) {
-            return 0;
+// tune <data.epd|data.pgn> [epochs] [output header] [threads]
+void tune(const std::vector<std::string> &tokens) {
+    if (tokens.size() < 2) {
+        std::cout << "usage: tune <data.epd|data.pgn> [epochs] [output] [threads]" << std::endl;
+        return;
+    }
+    const std::string &path = tokens[1];
+    int epochs = tokens.size() > 2 ? std::stoi(tokens[2]) : 1000;
+    std::string output = tokens.size() > 3 ? tokens[3] : "eval_params.hpp";
+    int threads = tokens.size() > 4 ? std::stoi(tokens[4]) : std::max(1u, std::thread::hardware_concurrency());
+
+    auto start = std::chrono::high_resolution_clock::now();
+    auto seconds = [&] {
+        return std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+    };
+
+    std::ifstream in(path);
+    if (!in) {
+        std::cout << "info string cannot open " << path << std::endl;
+        return;
+    }
+    std::vector<LabelledBoard> boards;
+    if (path.size() >= 4 && path.substr(path.size() - 4) == ".pgn") {
+        TuneVisitor visitor(boards);
+        pgn::StreamParser parser(in);
+        auto error = parser.readGames(visitor);
+        if (error) {
+            std::cout << "info string pgn error: " << error.message() << std::endl;
         }
-        if (score >= beta) {
-            return score;
+    } else {
+        load_epd(in, boards);
+    }
+    std::cout << "loaded " << boards.size() << " positions (" << boards.size() * sizeof(LabelledBoard) / 1024
+              << " KB packed) in " << seconds() << "s" << std::endl;
+
+    TuneParams params = initial_params();
+    std::vector<TuneSet> parts(threads);
+    std::vector<double> deviations(threads);
+    parallel_for(boards.size(), threads, [&](int t, size_t begin, size_t end) {
+        extract_features(boards, begin, end, params, parts[t], deviations[t]);
+    });
+
+    TuneSet set;
+    double deviation = 0;
+    for (int t = 0; t < threads; t++) {
+        uint32_t shift = static_cast<uint32_t>(set.features.size());
+        for (auto pos : parts[t].positions) {
+            pos.begin += shift;
+            pos.end += shift;
+            set.positions.push_back(pos);
         }
-        if (score > best_value) {
-            best_value = score;
-            if (score > alpha) {
-                alpha = score;
-                info.pv[ply] = move;
+        set.features.insert(set.features.end(), parts[t].features.begin(), parts[t].features.end());
+        deviation += deviations[t];
+        parts[t] = TuneSet();
+    }
+    boards = std::vector<LabelledBoard>();
+    if (set.positions.empty()) {
+        std::cout << "info string no usable positions in " << path << std::endl;
+        return;
+    }
+
+    std::cout << "extracted " << set.positions.size() << " positions, " << set.features.size() << " features ("
+              << set.features.size() * sizeof(TuneFeature) / (1024 * 1024) << " MB) in " << seconds() << "s,"
+              << " mean deviation from the engine eval " << deviation / set.positions.size() << std::endl;
+
+    double k = fit_k(set, params, threads);
+    std::cout << "k " << k << " error " << tune_error(set, params, k, threads) << std::endl;
+
+    const double rate = 1.0;
+    const double beta1 = 0.9;
+    const double beta2 = 0.999;
+    TuneParams m(term::COUNT);
+    TuneParams v(term::COUNT);
+    std::vector<TuneParams> gradients(threads, TuneParams(term::COUNT));
+
+    for (int epoch = 1; epoch <= epochs; epoch++) {
+        parallel_for(set.positions.size(), threads, [&](int t, size_t begin, size_t end) {
+            TuneParams &gradient = gradients[t];
+            std::fill(gradient.begin(), gradient.end(), std::array<double, 2>{0, 0});
+
+            for (size_t i = begin; i < end; i++) {
+                const TunePosition &pos = set.positions[i];
+                double s = sigmoid(k, tune_eval(set, pos, params));
+                double g = (s - pos.result) * s * (1 - s);
+                double mg = g * pos.phase / PHASE_MAX;
+                double eg = g * (PHASE_MAX - pos.phase) / PHASE_MAX * pos.scale / SCALE_NORMAL;
+                for (uint32_t f = pos.begin; f < pos.end; f++) {
+                    gradient[set.features[f].index][0] += mg * set.features[f].coeff;
+                    gradient[set.features[f].index][1] += eg * set.features[f].coeff;
+                }
             }
+        });
+
+        for (int i = 0; i < term::COUNT; i++) {
+            for (int half = 0; half < 2; half++) {
+                double g = 0;
+                for (const auto &gradient : gradients) {
+                    g += gradient[i][half];
+                }
+                g *= 2 * k / set.positions.size();
+                m[i][half] = beta1 * m[i][half] + (1 - beta1) * g;
+                v[i][half] = beta2 * v[i][half] + (1 - beta2) * g * g;
+                double m_hat = m[i][half] / (1 - std::pow(beta1, epoch));
+                double v_hat = v[i][half] / (1 - std::pow(beta2, epoch));
+                params[i][half] -= rate * m_hat / (std::sqrt(v_hat) + 1e-8);
+            }
+        }
+
+        if (epoch % 50 == 0 || epoch == epochs) {
+            std::cout << "epoch " << epoch << " error " << tune_error(set, params, k, threads) << " time "
+                      << seconds() << "s" << std::endl;
         }
     }
 
-    return best_value;
+    if (write_params(params, output)) {
+        std::cout << "wrote " << output << std::endl;
+    } else {
+        std::cout << "info string cannot write " << output << std::endl;
+    }
 }
+#endif
 
-chess::Move noisy_boy(Board &board, int wtime = 0, int btime = 0, int winc = 0, int binc = 0) {
-    Move best_move;
-    SearchInfo info = SearchInfo();
-    info.nodes = 0;
-    info.pv.resize(MAX_DEPTH);
-
-    auto time_remaining = (board.sideToMove() == Color::WHITE) ? wtime : btime;
-    auto increment = (board.sideToMove() == Color::WHITE) ? winc : binc;
+// Searches run on their own thread so that the UCI thread keeps answering
+// isready, stop, ponderhit and quit while the engine thinks.
+std::thread search_thread;
 
-    auto start = std::chrono::high_resolution_clock::now();
+void wait_for_search() {
+    if (search_thread.joinable()) {
+        search_thread.join();
+    }
+}
 
-    info.max_time = start +
-        std::chrono::milliseconds(time_remaining / 40) + std::chrono::milliseconds(increment / 2);
+void stop_and_wait() {
+    stop_search.store(true, std::memory_order_relaxed);
+    pondering.store(false, std::memory_order_relaxed);
+    wait_for_search();
+}
 
-    for (int depth = 1; depth < MAX_DEPTH; depth++) {
-        int alpha = -MATE_VALUE;
-        int beta = MATE_VALUE;
-        int best_value = -MATE_VALUE;
+void start_search(const NoisyBoard &board, const SearchLimits &limits) {
+    stop_and_wait();
 
-        int score = negamax(board, alpha, beta, depth, 0, info);
-        auto duration = get_duration(start);
-        auto current_time = std::chrono::high_resolution_clock::now();
-        if (current_time > info.max_time) {
-            break;
-        }  
+    stop_search.store(false, std::memory_order_relaxed);
+    pondering.store(limits.ponder, std::memory_order_relaxed);
 
-        auto nps = info.nodes / (get_duration(start).count() + 1);
-        std::string pvLine = uci::moveToUci(best_move);
+    search_thread = std::thread([board = board, limits]() mutable {
+        auto start = std::chrono::high_resolution_clock::now();
+        SearchInfo info;
+        Move best_move = noisy_boy(board, info, limits);
+        Move reply = ponder_move(board, info, best_move);
+        auto end = std::chrono::high_resolution_clock::now();
 
-        std::cout << "info depth " << depth << " score cp " << score << " time " << duration.count() 
-        << " nodes" << info.nodes << " nps " <<  nps << " pv " << pvLine << std::endl;
+        auto duration = std::chrono::duration_cast<std::chrono::seconds>(end - start).count();
 
-        if (score > best_value) {
-            best_move = info.pv[0];
-            best_value = score;   
+        std::lock_guard<std::mutex> lock(cout_mutex);
+        // UCI's null move when the root has no legal moves
+        std::cout << "bestmove " << (best_move.move() == Move::NO_MOVE ? "0000" : uci::moveToUci(best_move));
+        if (reply.move() != Move::NO_MOVE) {
+            std::cout << " ponder " << uci::moveToUci(reply);
         }
-    }
+        std::cout << std::endl;
+        std::cout << " (calc time " << duration << "s)" << std::endl;
+    });
+}
 
-    return best_move;
+// Reads a whole token as a number of at least minimum. Leaves value alone
+// and returns false for anything else, such as "x", "12abc" or an out of
+// range value.
+template <typename T>
+bool parse_number(const std::string &token, T &value, T minimum = std::numeric_limits<T>::min()) {
+    std::istringstream in(token);
+    T parsed;
+    if (!(in >> parsed) || !in.eof() || parsed < minimum) {
+        return false;
+    }
+    value = parsed;
+    return true;
 }
 
-void uci_commands(Board &board, const std::string &message) {
+void uci_commands(NoisyBoard &board, const std::string &message) {
     std::string msg = message;
 
     std::istringstream iss(msg);
@@ -408,26 +3129,97 @@ void uci_commands(Board &board, const std::string &message) {
     }
 
     if (msg == "quit") {
+        stop_and_wait();
         std::exit(0);  
     }
 
+    if (msg == "stop") {
+        stop_and_wait();
+        return;
+    }
+
+    if (msg == "ponderhit") {
+        // From here on the normal time limits of the search apply
+        pondering.store(false, std::memory_order_relaxed);
+        return;
+    }
+
     if (msg == "uci") {
         std::cout << "id name NoisyBoy 0.1.1" << std::endl;
         std::cout << "id author Felipe Langoni Ramos" << std::endl;
+        std::cout << "option name Hash type spin default 16 min 1 max 65536" << std::endl;
+        std::cout << "option name Threads type spin default 1 min 1 max 256" << std::endl;
+        std::cout << "option name Ponder type check default false" << std::endl;
+        std::cout << "option name UseNNUE type check default false" << std::endl;
+        std::cout << "option name EvalFile type string default " << eval_file << std::endl;
+        std::cout << "option name TablebasePath type string default <empty>" << std::endl;
+        std::cout << "option name TablebaseProbeDepth type spin default 1 min 1 max 100" << std::endl;
         std::cout << "uciok" << std::endl;
         return;
     }
 
     if (msg == "isready") {
+        std::lock_guard<std::mutex> lock(cout_mutex);
         std::cout << "readyok" << std::endl;
         return;
     }
 
+    if (tokens.empty()) {
+        return;
+    }
+
+    // Everything below changes engine state, which the GUI may only do
+    // once the search is over
+    if (tokens[0] != "go") {
+        wait_for_search();
+    }
+
     if (msg == "ucinewgame") {
+        tt.clear();
         return;
     }
 
-    if (msg == "setoption") {
+    if (tokens[0] == "setoption") {
+        // setoption name <id> value <x>
+        std::string name, value;
+        size_t i = 1;
+        if (i < tokens.size() && tokens[i] == "name") {
+            for (i++; i < tokens.size() && tokens[i] != "value"; i++) {
+                name += (name.empty() ? "" : " ") + tokens[i];
+            }
+        }
+        if (i < tokens.size() && tokens[i] == "value") {
+            for (i++; i < tokens.size(); i++) {
+                value += (value.empty() ? "" : " ") + tokens[i];
+            }
+        }
+
+        int number = 0;
+        bool numeric = parse_number(value, number);
+        if (name == "Hash" && numeric) {
+            tt.resize(std::clamp(number, 1, 65536));
+        } else if (name == "Threads" && numeric) {
+            thread_count = std::clamp(number, 1, 256);
+        } else if (name == "UseNNUE") {
+            use_nnue = value == "true" && load_network();
+            board.refresh_accumulator();
+            clear_eval_caches();
+        } else if (name == "EvalFile" && !value.empty()) {
+            eval_file = value;
+            nnue_network.reset();
+            if (use_nnue) {
+                use_nnue = load_network();
+                board.refresh_accumulator();
+            }
+            clear_eval_caches();
+        } else if (name == "TablebasePath") {
+            size_t found = tablebases.init(value);
+            std::cout << "info string found " << found << " tablebases, largest " << tablebases.largest()
+                      << " pieces" << std::endl;
+            tt.clear();
+        } else if (name == "TablebaseProbeDepth" && numeric) {
+            tb_probe_depth = std::clamp(number, 1, 100);
+        }
         return;
     }
 
@@ -470,43 +3262,116 @@ void uci_commands(Board &board, const std::string &message) {
         std::cout << board.getFen() << std::endl;
     }
 
-    if (msg.substr(0, 2) == "go") {
+    if (tokens[0] == "go") {
+        SearchLimits limits;
+        bool limited = false;
 
-        std::unordered_map<std::string, int> params = {
-            {"wtime", 300000},
-            {"btime", 300000},
-            {"winc", 0},
-            {"binc", 0}
-        };
-        
-        std::istringstream iss(msg); 
-        std::string token;
-        
-        for (size_t i = 0; i < 4; ++i) {
-            iss >> token;
+        for (size_t i = 1; i < tokens.size(); ++i) {
+            const std::string &token = tokens[i];
+            bool has_value = i + 1 < tokens.size();
+
+            if (token == "infinite") {
+                limits.infinite = true;
+            } else if (token == "ponder") {
+                limits.ponder = true;
+            } else if (!has_value) {
+                continue;
+            }
+
+            // A malformed or negative value is skipped together with its name.
+            // A clock that already ran out (some GUIs send a negative one)
+            // leaves the least possible time instead.
+            bool parsed;
             if (token == "wtime") {
-                iss >> params["wtime"];
+                parsed = parse_number(tokens[++i], limits.wtime);
+                limits.wtime = limits.wtime < 0 ? 1 : limits.wtime;
             } else if (token == "btime") {
-                iss >> params["btime"];
+                parsed = parse_number(tokens[++i], limits.btime);
+                limits.btime = limits.btime < 0 ? 1 : limits.btime;
             } else if (token == "winc") {
-                iss >> params["winc"];
+                parsed = parse_number(tokens[++i], limits.winc, 0);
             } else if (token == "binc") {
-                iss >> params["binc"];
+                parsed = parse_number(tokens[++i], limits.binc, 0);
+            } else if (token == "movestogo") {
+                parsed = parse_number(tokens[++i], limits.movestogo, 0);
+            } else if (token == "movetime") {
+                parsed = parse_number(tokens[++i], limits.movetime, 0);
+            } else if (token == "depth") {
+                parsed = parse_number(tokens[++i], limits.depth);
+                limits.depth = std::clamp(limits.depth, 1, MAX_DEPTH - 1);
+            } else if (token == "nodes") {
+                parsed = parse_number(tokens[++i], limits.nodes, 0LL);
+            } else if (token == "mate") {
+                parsed = parse_number(tokens[++i], limits.mate, 0);
+            } else {
+                continue;
             }
+            limited = limited || parsed;
         }
-        auto start = std::chrono::high_resolution_clock::now();
-        Move best_move = noisy_boy(board, params["wtime"], params["btime"],
-                                   params["winc"], params["binc"]);  
-        auto end = std::chrono::high_resolution_clock::now();
-        
-        auto duration = std::chrono::duration_cast<std::chrono::seconds>(end - start).count();
-        
-        std::cout << "bestmove " << uci::moveToUci(best_move)  << std::endl;
-        std::cout << " (calc time " << duration << "s)" << std::endl;
+
+        // A bare "go" plays as if five minutes were left on the clock
+        if (!limited && !limits.infinite) {
+            limits.wtime = 300000;
+            limits.btime = 300000;
+        }
+
+        start_search(board, limits);
+        return;
+    }
+    if (tokens[0] == "bench") {
+        if (tokens.size() > 1 && tokens[1] == "eval") {
+            int iterations = 1000000;
+            if (tokens.size() > 2) {
+                parse_number(tokens[2], iterations);
+            }
+            bench_eval(iterations);
+        } else if (tokens.size() > 1 && tokens[1] == "see") {
+            bench_see();
+        } else if (tokens.size() > 1 && tokens[1] == "endgame") {
+            bench_endgames();
+        } else {
+            int depth = 6;
+            int threads = thread_count;
+            if (tokens.size() > 1) {
+                parse_number(tokens[1], depth);
+            }
+            if (tokens.size() > 2) {
+                parse_number(tokens[2], threads);
+            }
+            bench_search(std::clamp(depth, 1, MAX_DEPTH - 1), std::clamp(threads, 1, 256));
+        }
+        return;
+    }
+#if TUNE
+    if (tokens[0] == "tune") {
+        tune(tokens);
+        return;
+    }
+#endif
+    if (tokens[0] == "tbgen") {
+        // tbgen [dir] [threads] [tables...]: generates tables for TablebasePath, see tbgen.hpp
+        std::string dir = tokens.size() > 1 ? tokens[1] : "tables";
+        int threads = std::max(1u, std::thread::hardware_concurrency());
+        if (tokens.size() > 2) {
+            parse_number(tokens[2], threads);
+        }
+        std::vector<std::string> names(tokens.begin() + std::min<size_t>(tokens.size(), 3), tokens.end());
+        tb::generate(names.empty() ? tb::DEFAULT_TABLES : names, dir, std::max(threads, 1), std::cout);
+        return;
+    }
+    if (tokens[0] == "export_net") {
+        // export_net <file>: writes the reference network, see reference_network()
+        std::string path = tokens.size() > 1 ? tokens[1] : eval_file;
+        if (nnue::save(*reference_network(), path)) {
+            std::cout << "info string wrote reference network to " << path << std::endl;
+        } else {
+            std::cout << "info string cannot write " << path << std::endl;
+        }
+        return;
     }
     if (msg.substr(0, 4) == "eval") {
         auto start = std::chrono::high_resolution_clock::now();
-        int s = score(board);  
+        int s = score(board, *std::make_unique<EvalTables>());  
         auto end = std::chrono::high_resolution_clock::now();
         
         auto duration = std::chrono::duration_cast<std::chrono::seconds>(end - start).count();
@@ -528,12 +3393,16 @@ void uci_commands(Board &board, const std::string &message) {
 
 
 int main() {
+    init_reductions();
+    init_cuckoo();
+    init_pawn_keys();
+
     std::string input;
-    Board board = Board("rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1");
-    while (true) {
-        std::getline(std::cin, input);
+    NoisyBoard board = NoisyBoard("rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1");
+    while (std::getline(std::cin, input)) {
         uci_commands(board,input);
     }
+    stop_and_wait();
     
     return 0;
 }
@@ -0,0 +1,394 @@
+#pragma once
+
+// Endgame tablebases for NoisyBoy. Only the engine's own format below is
+// read; Syzygy tables are not supported.
+//
+// init() scans the directories of a path (separated by ':') for tables,
+// maps every file read-only and keeps it mapped until the next init(). The
+// mappings are shared by all search threads, which only ever read them, so
+// init() may only be called while no search runs.
+//
+// Tables (KQvKR.nbtb) are written by tb::generate() in tbgen.hpp: a 16
+// byte header (magic "NBTB", version, piece count, 0) followed by one byte
+// per position, indexed by generated_index(). The byte is 0 for draws and
+// impossible positions, otherwise one more than the distance to mate in
+// plies, which is odd when the side to move wins and even when it loses.
+// The 50-move rule is ignored.
+//
+// Results are from the point of view of the side to move. Probes fail
+// when the position has castling rights, an en passant square, or no
+// table covers its material.
+
+#include <chess.hpp>
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace tb {
+
+enum Wdl : int {
+    LOSS = -1,
+    DRAW = 0,
+    WIN = 1
+};
+
+// Read-only mapping of a whole file
+class MappedFile {
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    MappedFile(MappedFile &&other) noexcept { *this = std::move(other); }
+
+    MappedFile &operator=(MappedFile &&other) noexcept {
+        if (this != &other) {
+            unmap();
+            data_ = other.data_;
+            size_ = other.size_;
+            other.data_ = nullptr;
+            other.size_ = 0;
+        }
+        return *this;
+    }
+
+    ~MappedFile() { unmap(); }
+
+    bool map(const std::string &path) {
+        unmap();
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        if (::fstat(fd, &st) == 0 && st.st_size > 0) {
+            void *data = ::mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (data != MAP_FAILED) {
+                data_ = static_cast<const uint8_t *>(data);
+                size_ = st.st_size;
+                // Probes jump around the whole file
+                ::madvise(data, size_, MADV_RANDOM);
+            }
+        }
+        ::close(fd);
+        return data_ != nullptr;
+    }
+
+    void unmap() {
+        if (data_) {
+            ::munmap(const_cast<uint8_t *>(data_), size_);
+        }
+        data_ = nullptr;
+        size_ = 0;
+    }
+
+    const uint8_t *data() const { return data_; }
+    size_t size() const { return size_; }
+    bool mapped() const { return data_ != nullptr; }
+
+private:
+    const uint8_t *data_ = nullptr;
+    size_t size_ = 0;
+};
+
+struct Table {
+    int pieces = 0;
+    // Win/draw/loss and distance to mate in one
+    MappedFile dtm;
+};
+
+constexpr uint32_t GENERATED_MAGIC = 0x4254424e;
+constexpr uint32_t GENERATED_VERSION = 1;
+constexpr size_t GENERATED_HEADER = 16;
+
+// A position as the tables see it: the pieces in the order of the table's
+// name (kings first, then queens down to pawns, the name's first side
+// playing white) as chess::Piece indices, their squares, and the side to
+// move
+struct TablePosition {
+    std::string name;
+    int count = 0;
+    std::array<int, 8> pieces{};
+    std::array<int, 8> squares{};
+    int side = 0;
+};
+
+namespace detail {
+
+constexpr const char *PIECE_LETTERS = "PNBRQK";
+
+inline int letter_type(char c) {
+    return static_cast<int>(std::strchr(PIECE_LETTERS, c) - PIECE_LETTERS);
+}
+
+// Table names put the side with more pieces, then with the more valuable
+// ones, first
+inline bool stronger(const std::string &a, const std::string &b) {
+    if (a.size() != b.size()) {
+        return a.size() > b.size();
+    }
+    for (size_t i = 0; i < a.size(); i++) {
+        if (a[i] != b[i]) {
+            return letter_type(a[i]) > letter_type(b[i]);
+        }
+    }
+    return false;
+}
+
+// "K[QRBNP]*vK[QRBNP]*" with the stronger side first
+inline bool valid_signature(const std::string &name) {
+    size_t v = name.find('v');
+    if (v == std::string::npos || name.size() > 9) {
+        return false;
+    }
+    std::string white = name.substr(0, v);
+    std::string black = name.substr(v + 1);
+    for (const std::string &side : {white, black}) {
+        if (side.empty() || side[0] != 'K' || side.find_first_not_of("QRBNP", 1) != std::string::npos
+            || !std::is_sorted(side.begin(), side.end(),
+                               [](char a, char b) { return letter_type(a) > letter_type(b); })) {
+            return false;
+        }
+    }
+    return !stronger(black, white);
+}
+
+}  // namespace detail
+
+// Puts pieces[0..count) on squares into table order, swapping the colours
+// (and mirroring the ranks) when black has the stronger side
+inline TablePosition table_position(const int *pieces, const int *squares, int count, int side) {
+    // White's pieces, then black's, each from the king down to the pawns
+    std::array<int, 8> order{};
+    int ordered = 0;
+    for (int piece : {5, 4, 3, 2, 1, 0, 11, 10, 9, 8, 7, 6}) {
+        for (int i = 0; i < count; i++) {
+            if (pieces[i] == piece) {
+                order[ordered++] = i;
+            }
+        }
+    }
+
+    std::array<std::string, 2> sides;
+    for (int i = 0; i < count; i++) {
+        sides[pieces[order[i]] / 6] += detail::PIECE_LETTERS[pieces[order[i]] % 6];
+    }
+    bool flip = detail::stronger(sides[1], sides[0]);
+
+    TablePosition pos;
+    pos.name = flip ? sides[1] + "v" + sides[0] : sides[0] + "v" + sides[1];
+    pos.count = count;
+    pos.side = flip ? side ^ 1 : side;
+    int n = 0;
+    for (int color : {flip ? 1 : 0, flip ? 0 : 1}) {
+        for (int i = 0; i < count; i++) {
+            int piece = pieces[order[i]];
+            if (piece / 6 == color) {
+                pos.pieces[n] = flip ? (piece + 6) % 12 : piece;
+                pos.squares[n] = flip ? squares[order[i]] ^ 56 : squares[order[i]];
+                n++;
+            }
+        }
+    }
+    return pos;
+}
+
+inline TablePosition table_position(const chess::Board &board) {
+    std::array<int, 8> pieces{};
+    std::array<int, 8> squares{};
+    int count = 0;
+    for (chess::Bitboard occ = board.occ(); !occ.empty() && count < 8; count++) {
+        chess::Square sq = occ.pop();
+        pieces[count] = static_cast<int>(board.at(sq));
+        squares[count] = sq.index();
+    }
+    return table_position(pieces.data(), squares.data(), count, static_cast<int>(board.sideToMove()));
+}
+
+// Positions of a generated table: the white king on 16 squares without
+// pawns and on 32 with them (see generated_index()), all other pieces on
+// any square, and either side to move
+inline size_t generated_size(int count, bool pawns) {
+    size_t size = 2 * (pawns ? 32 : 16);
+    for (int i = 1; i < count; i++) {
+        size *= 64;
+    }
+    return size;
+}
+
+// Mirrors the position so that the white king is on files a-d, and
+// without pawns also on ranks 1-4
+inline size_t generated_index(const int *squares, int count, int side, bool pawns) {
+    int flip = squares[0] & 4 ? 7 : 0;
+    if (!pawns && (squares[0] & 32)) {
+        flip |= 56;
+    }
+    int king = squares[0] ^ flip;
+    size_t index = side * (pawns ? 32 : 16) + (king >> 3) * 4 + (king & 3);
+    for (int i = 1; i < count; i++) {
+        index = index * 64 + (squares[i] ^ flip);
+    }
+    return index;
+}
+
+inline bool has_pawns(const std::string &name) {
+    return name.find('P') != std::string::npos;
+}
+
+class Tablebases {
+public:
+    // Replaces the loaded tables by the ones found under path, "<empty>"
+    // or an empty path unloads them. Returns the number of tables found.
+    size_t init(const std::string &path) {
+        tables_.clear();
+        largest_ = 0;
+        if (path.empty() || path == "<empty>") {
+            return 0;
+        }
+
+        size_t begin = 0;
+        while (begin <= path.size()) {
+            size_t end = std::min(path.find(':', begin), path.size());
+            scan(path.substr(begin, end - begin));
+            begin = end + 1;
+        }
+        return tables_.size();
+    }
+
+    // Number of pieces of the largest table, zero without tables
+    int largest() const { return largest_; }
+
+    bool probe_wdl(const chess::Board &board, Wdl &result) const {
+        uint8_t value;
+        if (!probe_board(board, value)) {
+            return false;
+        }
+        result = value == 0 ? DRAW : (value - 1) % 2 ? WIN : LOSS;
+        return true;
+    }
+
+    // Distance in plies to the mate of probe_wdl(), 0 for draws
+    bool probe_dtm(const chess::Board &board, int &distance) const {
+        uint8_t value;
+        if (!probe_board(board, value)) {
+            return false;
+        }
+        distance = value == 0 ? 0 : value - 1;
+        return true;
+    }
+
+    // Raw entry of a table, see the top of this file. Bare kings
+    // are a draw without a table.
+    bool probe_generated(const TablePosition &pos, uint8_t &value) const {
+        if (pos.count == 2) {
+            value = 0;
+            return true;
+        }
+        auto it = tables_.find(pos.name);
+        if (it == tables_.end() || !it->second.dtm.mapped()) {
+            return false;
+        }
+        size_t index = generated_index(pos.squares.data(), pos.count, pos.side, has_pawns(pos.name));
+        value = it->second.dtm.data()[GENERATED_HEADER + index];
+        return true;
+    }
+
+    // Reduces moves to the root moves that keep the best result, and for a
+    // won position to those that win fastest. Leaves moves untouched and
+    // returns false when any of them cannot be probed.
+    bool probe_root(chess::Board &board, chess::Movelist &moves) const {
+        std::vector<std::pair<int, int>> ranks;
+        for (const auto &move : moves) {
+            board.makeMove(move);
+            Wdl wdl = DRAW;
+            int distance = 0;
+            bool ok = probe_wdl(board, wdl);
+            if (ok && wdl != DRAW && !probe_dtm(board, distance)) {
+                distance = 0;
+            }
+            board.unmakeMove(move);
+            if (!ok) {
+                return false;
+            }
+            // Our result after the move, then quicker wins and slower losses
+            int result = -static_cast<int>(wdl);
+            ranks.emplace_back(result, result > 0 ? -distance : distance);
+        }
+
+        auto best = *std::max_element(ranks.begin(), ranks.end());
+        chess::Movelist kept;
+        for (size_t i = 0; i < ranks.size(); i++) {
+            if (ranks[i] == best) {
+                kept.add(moves[i]);
+            }
+        }
+        moves = kept;
+        return true;
+    }
+
+    // Bytes of all mapped files
+    size_t mapped_bytes() const {
+        size_t bytes = 0;
+        for (const auto &[name, table] : tables_) {
+            bytes += table.dtm.size();
+        }
+        return bytes;
+    }
+
+private:
+    void scan(const std::string &dir) {
+        std::error_code error;
+        for (const auto &entry : std::filesystem::directory_iterator(dir, error)) {
+            std::string name = entry.path().stem().string();
+            std::string ext = entry.path().extension().string();
+            if (ext != ".nbtb" || !detail::valid_signature(name)) {
+                continue;
+            }
+
+            MappedFile file;
+            int pieces = static_cast<int>(name.size()) - 1;
+            if (!file.map(entry.path().string()) || !valid_generated(file, pieces, has_pawns(name))) {
+                continue;
+            }
+
+            Table &table = tables_[name];
+            table.pieces = pieces;
+            table.dtm = std::move(file);
+            largest_ = std::max(largest_, table.pieces);
+        }
+    }
+
+    static bool valid_generated(const MappedFile &file, int pieces, bool pawns) {
+        uint32_t header[4];
+        if (file.size() != GENERATED_HEADER + generated_size(pieces, pawns)) {
+            return false;
+        }
+        std::memcpy(header, file.data(), sizeof(header));
+        return header[0] == GENERATED_MAGIC && header[1] == GENERATED_VERSION
+            && header[2] == static_cast<uint32_t>(pieces);
+    }
+
+    bool probe_board(const chess::Board &board, uint8_t &value) const {
+        if (board.occ().count() > largest_ || !board.castlingRights().isEmpty()
+            || board.enpassantSq() != chess::Square::NO_SQ) {
+            return false;
+        }
+        return probe_generated(table_position(board), value);
+    }
+
+    std::map<std::string, Table> tables_;
+    int largest_ = 0;
+};
+
+}  // namespace tb
@@ -0,0 +1,618 @@
+#pragma once
+
+// Retrograde generator of the tables in tablebase.hpp, for materials of
+// up to four pieces without pawns on both sides (there is no en passant in
+// the tables).
+//
+// A first pass over every placement of the pieces marks the impossible
+// ones, counts the moves of each position that keep its material, and
+// resolves the moves that change it (captures and promotions) by probing
+// the smaller tables, which are generated first. Positions are then
+// decided level by level in plies to mate, walking the moves backwards
+// from the positions of the current level: a predecessor of a loss is a
+// win one ply longer, and a position whose moves all lead to wins of the
+// opponent is lost. Undecided positions are draws. Both passes are split
+// over threads.
+
+#include "tablebase.hpp"
+
+#include <atomic>
+#include <cassert>
+#include <cctype>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <ostream>
+#include <random>
+#include <thread>
+
+namespace tb {
+
+constexpr int GENERATED_MAX_PIECES = 4;
+
+// What tbgen builds by default: every 3-man table and the 4-man endings
+// that come up in practice
+inline const std::vector<std::string> DEFAULT_TABLES{
+    "KQvK", "KRvK", "KBvK", "KNvK", "KPvK",
+    "KQvKQ", "KQvKR", "KQvKB", "KQvKN", "KQvKP",
+    "KRvKR", "KRvKB", "KRvKN", "KRvKP",
+    "KBBvK", "KBNvK", "KNNvK",
+};
+
+struct GenerationStats {
+    std::string name;
+    size_t positions = 0;
+    size_t wins = 0;
+    size_t draws = 0;
+    size_t losses = 0;
+    // Longest mate in plies
+    int longest = 0;
+    // Peak memory of the generation, not counting the smaller tables
+    size_t memory = 0;
+    double seconds = 0;
+};
+
+namespace detail {
+
+// Kings first, then queens down to pawns, the stronger side first
+inline std::string canonical_name(std::string white, std::string black) {
+    auto by_value = [](char a, char b) { return letter_type(a) > letter_type(b); };
+    std::sort(white.begin(), white.end(), by_value);
+    std::sort(black.begin(), black.end(), by_value);
+    return stronger(black, white) ? black + "v" + white : white + "v" + black;
+}
+
+// The materials one capture or promotion away, bare kings excluded
+inline std::vector<std::string> dependencies(const std::string &name) {
+    size_t v = name.find('v');
+    std::array<std::string, 2> sides{{name.substr(0, v), name.substr(v + 1)}};
+    std::vector<std::string> result;
+    auto add = [&](const std::string &white, const std::string &black) {
+        std::string dep = canonical_name(white, black);
+        if (dep != "KvK" && std::find(result.begin(), result.end(), dep) == result.end()) {
+            result.push_back(dep);
+        }
+    };
+
+    for (int us = 0; us < 2; us++) {
+        const std::string &own = sides[us];
+        const std::string &their = sides[us ^ 1];
+        for (size_t i = 1; i < own.size(); i++) {
+            // Captures of our pieces
+            std::string captured = own.substr(0, i) + own.substr(i + 1);
+            us == 0 ? add(captured, their) : add(their, captured);
+            if (own[i] != 'P') {
+                continue;
+            }
+            // Promotions, with or without a capture
+            for (char promoted : {'Q', 'R', 'B', 'N'}) {
+                std::string after = own.substr(0, i) + promoted + own.substr(i + 1);
+                us == 0 ? add(after, their) : add(their, after);
+                for (size_t j = 1; j < their.size(); j++) {
+                    std::string rest = their.substr(0, j) + their.substr(j + 1);
+                    us == 0 ? add(after, rest) : add(rest, after);
+                }
+            }
+        }
+    }
+    return result;
+}
+
+inline uint64_t piece_attacks(int type, int color, int sq, uint64_t occ) {
+    chess::Square square(sq);
+    switch (type) {
+    case 0: return chess::attacks::pawn(chess::Color(color), square).getBits();
+    case 1: return chess::attacks::knight(square).getBits();
+    case 2: return chess::attacks::bishop(square, occ).getBits();
+    case 3: return chess::attacks::rook(square, occ).getBits();
+    case 4: return chess::attacks::queen(square, occ).getBits();
+    default: return chess::attacks::king(square).getBits();
+    }
+}
+
+// Entry values while generating: 0 undecided, 1 + plies to mate once
+// decided, ILLEGAL for placements that cannot occur
+constexpr uint8_t ILLEGAL = 255;
+constexpr int MAX_LEVEL = 253;
+
+class Generator {
+public:
+    Generator(const std::string &name, const Tablebases &smaller, int threads)
+        : name_(name), smaller_(smaller), threads_(std::max(threads, 1)) {
+        pawns_ = has_pawns(name);
+        size_t v = name.find('v');
+        count_ = static_cast<int>(name.size()) - 1;
+        for (int i = 0, n = 0; i < static_cast<int>(name.size()); i++) {
+            if (name[i] != 'v') {
+                pieces_[n++] = letter_type(name[i]) + (i > static_cast<int>(v) ? 6 : 0);
+            }
+        }
+        size_ = generated_size(count_, pawns_);
+        values_ = std::make_unique<std::atomic<uint8_t>[]>(size_);
+        moves_ = std::make_unique<std::atomic<uint8_t>[]>(size_);
+    }
+
+    GenerationStats run() {
+        auto start = std::chrono::high_resolution_clock::now();
+        GenerationStats stats;
+        stats.name = name_;
+        stats.positions = size_;
+
+        seeds_.assign(MAX_LEVEL + 2, {});
+        parallel([&](size_t begin, size_t end, Lists &lists) { initialize(begin, end, lists); }, size_);
+
+        std::vector<uint32_t> current;
+        size_t peak_lists = 0;
+        for (int level = 0; level <= MAX_LEVEL; level++) {
+            // Positions whose best result leaves the material at this level
+            for (uint32_t index : seeds_[level]) {
+                uint8_t expected = 0;
+                if (values_[index].compare_exchange_strong(expected, level + 1)) {
+                    current.push_back(index);
+                }
+            }
+            std::vector<uint32_t>().swap(seeds_[level]);
+            if (current.empty()) {
+                continue;
+            }
+            stats.longest = level;
+
+            size_t queued = 0;
+            for (const auto &seeds : seeds_) {
+                queued += seeds.size();
+            }
+            peak_lists = std::max(peak_lists, (current.size() + queued) * sizeof(uint32_t));
+
+            std::vector<uint32_t> next;
+            parallel([&](size_t begin, size_t end, Lists &lists) {
+                for (size_t i = begin; i < end; i++) {
+                    retreat(current[i], level, lists);
+                }
+            }, current.size(), &next);
+            current.swap(next);
+        }
+
+        for (size_t i = 0; i < size_; i++) {
+            uint8_t value = values_[i].load(std::memory_order_relaxed);
+            if (value == ILLEGAL) {
+                continue;
+            }
+            value == 0 ? stats.draws++ : (value - 1) % 2 ? stats.wins++ : stats.losses++;
+        }
+        stats.memory = 2 * size_ + peak_lists;
+        stats.seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+        return stats;
+    }
+
+    bool write(const std::string &path) const {
+        std::ofstream out(path, std::ios::binary);
+        uint32_t header[4] = {GENERATED_MAGIC, GENERATED_VERSION, static_cast<uint32_t>(count_), 0};
+        out.write(reinterpret_cast<const char *>(header), sizeof(header));
+        std::vector<uint8_t> buffer(1 << 16);
+        for (size_t i = 0; i < size_; i += buffer.size()) {
+            size_t n = std::min(buffer.size(), size_ - i);
+            for (size_t j = 0; j < n; j++) {
+                uint8_t value = values_[i + j].load(std::memory_order_relaxed);
+                buffer[j] = value == ILLEGAL ? 0 : value;
+            }
+            out.write(reinterpret_cast<const char *>(buffer.data()), n);
+        }
+        return static_cast<bool>(out);
+    }
+
+private:
+    struct Position {
+        std::array<int, GENERATED_MAX_PIECES> squares{};
+        int side = 0;
+    };
+
+    // Per-thread output of a pass: positions decided at the next level and
+    // seeds for later levels
+    struct Lists {
+        std::vector<uint32_t> next;
+        std::vector<std::pair<int, uint32_t>> seeds;
+    };
+
+    template <typename Body>
+    void parallel(Body body, size_t count, std::vector<uint32_t> *next = nullptr) {
+        std::vector<Lists> lists(threads_);
+        std::vector<std::thread> workers;
+        size_t chunk = (count + threads_ - 1) / threads_;
+        for (int t = 0; t < threads_; t++) {
+            size_t begin = std::min(count, t * chunk);
+            size_t end = std::min(count, begin + chunk);
+            workers.emplace_back([&, t, begin, end] { body(begin, end, lists[t]); });
+        }
+        for (auto &worker : workers) {
+            worker.join();
+        }
+        for (auto &list : lists) {
+            if (next) {
+                next->insert(next->end(), list.next.begin(), list.next.end());
+            }
+            for (const auto &[level, index] : list.seeds) {
+                seeds_[level].push_back(index);
+            }
+        }
+    }
+
+    Position decode(size_t index) const {
+        Position pos;
+        for (int i = count_ - 1; i > 0; i--) {
+            pos.squares[i] = index % 64;
+            index /= 64;
+        }
+        int kings = pawns_ ? 32 : 16;
+        int king = index % kings;
+        pos.squares[0] = (king / 4) * 8 + king % 4;
+        pos.side = static_cast<int>(index / kings);
+        return pos;
+    }
+
+    size_t index(const Position &pos) const {
+        return generated_index(pos.squares.data(), count_, pos.side, pawns_);
+    }
+
+    uint64_t occupancy(const Position &pos, int skip = -1) const {
+        uint64_t occ = 0;
+        for (int i = 0; i < count_; i++) {
+            if (i != skip) {
+                occ |= 1ULL << pos.squares[i];
+            }
+        }
+        return occ;
+    }
+
+    // Is square attacked by color, ignoring the piece skip (just captured)
+    bool attacked(const Position &pos, int square, int color, uint64_t occ, int skip = -1) const {
+        for (int i = 0; i < count_; i++) {
+            if (i != skip && pieces_[i] / 6 == color
+                && (piece_attacks(pieces_[i] % 6, color, pos.squares[i], occ) >> square & 1)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    int king(int color) const {
+        for (int i = 0; i < count_; i++) {
+            if (pieces_[i] == 5 + 6 * color) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    bool legal(const Position &pos) const {
+        uint64_t occ = 0;
+        for (int i = 0; i < count_; i++) {
+            int sq = pos.squares[i];
+            if (occ >> sq & 1) {
+                return false;
+            }
+            if (pieces_[i] % 6 == 0 && (sq < 8 || sq >= 56)) {
+                return false;
+            }
+            occ |= 1ULL << sq;
+        }
+        // The side that just moved cannot be in check
+        return !attacked(pos, pos.squares[king(pos.side ^ 1)], pos.side, occ);
+    }
+
+    // Result for the side that moved into after, changing the material, as
+    // an entry value
+    uint8_t convert(const Position &after, int mover, int promoted, int captured) const {
+        std::array<int, 8> pieces{};
+        std::array<int, 8> squares{};
+        int n = 0;
+        for (int i = 0; i < count_; i++) {
+            if (i != captured) {
+                pieces[n] = i == mover && promoted >= 0 ? promoted : pieces_[i];
+                squares[n++] = after.squares[i];
+            }
+        }
+        uint8_t value = 0;
+        bool found = smaller_.probe_generated(table_position(pieces.data(), squares.data(), n, after.side), value);
+        assert(found);
+        (void)found;
+        return value == 0 ? 0 : value + 1;
+    }
+
+    // Better of two results for the side to move: quicker wins, then draws,
+    // then slower losses. 0 is a draw.
+    static uint8_t better(uint8_t a, uint8_t b) {
+        auto rank = [](uint8_t v) { return v == 0 ? 0 : (v - 1) % 2 ? 1000 - v : v - 1000; };
+        return rank(a) >= rank(b) ? a : b;
+    }
+
+    // Calls quiet(after) for every legal move that keeps the material and
+    // returns the best result of the others, NONE if there are none
+    static constexpr int NONE = -1;
+
+    template <typename Quiet>
+    int moves(const Position &pos, Quiet quiet) const {
+        int us = pos.side;
+        int own_king = king(us);
+        uint64_t occ = occupancy(pos);
+        uint64_t own = 0;
+        uint64_t their = 0;
+        for (int i = 0; i < count_; i++) {
+            (pieces_[i] / 6 == us ? own : their) |= 1ULL << pos.squares[i];
+        }
+
+        int best = NONE;
+        auto leave = [&](uint8_t value) { best = best == NONE ? value : better(best, value); };
+
+        for (int i = 0; i < count_; i++) {
+            if (pieces_[i] / 6 != us) {
+                continue;
+            }
+            int type = pieces_[i] % 6;
+            int from = pos.squares[i];
+            uint64_t targets;
+            if (type == 0) {
+                int push = us == 0 ? 8 : -8;
+                targets = piece_attacks(0, us, from, occ) & their;
+                if (!(occ >> (from + push) & 1)) {
+                    targets |= 1ULL << (from + push);
+                    int start_rank = us == 0 ? 1 : 6;
+                    if (from / 8 == start_rank && !(occ >> (from + 2 * push) & 1)) {
+                        targets |= 1ULL << (from + 2 * push);
+                    }
+                }
+            } else {
+                targets = piece_attacks(type, us, from, occ) & ~own;
+            }
+
+            for (; targets; targets &= targets - 1) {
+                int to = __builtin_ctzll(targets);
+                int captured = -1;
+                if (their >> to & 1) {
+                    for (int j = 0; j < count_; j++) {
+                        if (j != i && pos.squares[j] == to) {
+                            captured = j;
+                        }
+                    }
+                }
+
+                Position after = pos;
+                after.squares[i] = to;
+                after.side ^= 1;
+                uint64_t after_occ = (occ & ~(1ULL << from)) | (1ULL << to);
+                int king_sq = i == own_king ? to : pos.squares[own_king];
+                if (attacked(after, king_sq, us ^ 1, after_occ, captured)) {
+                    continue;
+                }
+
+                bool promotion = type == 0 && (to < 8 || to >= 56);
+                if (promotion) {
+                    for (int promoted = 1; promoted <= 4; promoted++) {
+                        leave(convert(after, i, promoted + 6 * us, captured));
+                    }
+                } else if (captured >= 0) {
+                    leave(convert(after, i, -1, captured));
+                } else {
+                    quiet(after);
+                }
+            }
+        }
+        return best;
+    }
+
+    void initialize(size_t begin, size_t end, Lists &lists) {
+        for (size_t i = begin; i < end; i++) {
+            Position pos = decode(i);
+            if (!legal(pos)) {
+                values_[i].store(ILLEGAL, std::memory_order_relaxed);
+                continue;
+            }
+
+            int quiet = 0;
+            int left = moves(pos, [&](const Position &) { quiet++; });
+            moves_[i].store(quiet, std::memory_order_relaxed);
+
+            if (quiet == 0 && left == NONE) {
+                bool in_check = attacked(pos, pos.squares[king(pos.side)], pos.side ^ 1, occupancy(pos));
+                // Mated, or stalemate which stays undecided
+                if (in_check) {
+                    lists.seeds.emplace_back(0, i);
+                }
+            } else if (left != NONE && left != 0 && ((left - 1) % 2 == 1 || quiet == 0)) {
+                // A win through a capture or promotion, or a loss when there
+                // is nothing else to play
+                lists.seeds.emplace_back(left - 1, i);
+            }
+        }
+    }
+
+    // Walks the quiet moves leading to index backwards
+    void retreat(uint32_t index, int level, Lists &lists) {
+        Position pos = decode(index);
+        int mover = pos.side ^ 1;
+        uint64_t occ = occupancy(pos);
+
+        for (int i = 0; i < count_; i++) {
+            if (pieces_[i] / 6 != mover) {
+                continue;
+            }
+            int type = pieces_[i] % 6;
+            int to = pos.squares[i];
+            uint64_t origins;
+            if (type == 0) {
+                int push = mover == 0 ? 8 : -8;
+                int from = to - push;
+                origins = 0;
+                if (from >= 8 && from < 56 && !(occ >> from & 1)) {
+                    origins |= 1ULL << from;
+                    int double_rank = mover == 0 ? 3 : 4;
+                    if (to / 8 == double_rank && !(occ >> (from - push) & 1)) {
+                        origins |= 1ULL << (from - push);
+                    }
+                }
+            } else {
+                origins = piece_attacks(type, mover, to, occ) & ~occ;
+            }
+
+            for (; origins; origins &= origins - 1) {
+                Position before = pos;
+                before.squares[i] = __builtin_ctzll(origins);
+                before.side = mover;
+                size_t prev = this->index(before);
+                uint8_t value = values_[prev].load(std::memory_order_relaxed);
+                if (value != 0) {
+                    continue;
+                }
+
+                if (level % 2 == 0) {
+                    // The mover can reach a lost position
+                    uint8_t expected = 0;
+                    if (values_[prev].compare_exchange_strong(expected, level + 2)) {
+                        lists.next.push_back(prev);
+                    }
+                } else if (moves_[prev].fetch_sub(1) == 1) {
+                    // Every quiet move of the mover loses, unless leaving the
+                    // material does better
+                    int left = moves(before, [](const Position &) {});
+                    if (left == NONE) {
+                        claim(prev, level + 1, lists);
+                    } else if (left != 0 && (left - 1) % 2 == 0 && left - 1 <= level + 1) {
+                        claim(prev, level + 1, lists);
+                    } else if (left != 0 && (left - 1) % 2 == 0) {
+                        lists.seeds.emplace_back(left - 1, prev);
+                    }
+                }
+            }
+        }
+    }
+
+    void claim(size_t index, int level, Lists &lists) {
+        uint8_t expected = 0;
+        if (values_[index].compare_exchange_strong(expected, level + 1)) {
+            lists.next.push_back(index);
+        }
+    }
+
+    std::string name_;
+    const Tablebases &smaller_;
+    int threads_;
+    bool pawns_ = false;
+    int count_ = 0;
+    std::array<int, GENERATED_MAX_PIECES> pieces_{};
+    size_t size_ = 0;
+    std::unique_ptr<std::atomic<uint8_t>[]> values_;
+    // Undecided quiet moves of every position
+    std::unique_ptr<std::atomic<uint8_t>[]> moves_;
+    std::vector<std::vector<uint32_t>> seeds_;
+};
+
+}  // namespace detail
+
+// Generates the tables named in names, and the smaller ones they need,
+// into dir. Tables already in dir are kept. Reports progress, the time
+// and memory of every table and the probe latency to out.
+inline bool generate(const std::vector<std::string> &names, const std::string &dir, int threads, std::ostream &out) {
+    std::vector<std::string> order;
+    std::function<bool(const std::string &)> visit = [&](const std::string &name) {
+        if (std::find(order.begin(), order.end(), name) != order.end()) {
+            return true;
+        }
+        if (!detail::valid_signature(name) || static_cast<int>(name.size()) - 1 > GENERATED_MAX_PIECES
+            || (name.find('P') < name.find('v') && name.find('P', name.find('v')) != std::string::npos)) {
+            out << "info string cannot generate " << name << std::endl;
+            return false;
+        }
+        for (const auto &dep : detail::dependencies(name)) {
+            if (!visit(dep)) {
+                return false;
+            }
+        }
+        order.push_back(name);
+        return true;
+    };
+    for (const auto &name : names) {
+        if (!visit(name)) {
+            return false;
+        }
+    }
+
+    std::error_code error;
+    std::filesystem::create_directories(dir, error);
+    Tablebases tables;
+    tables.init(dir);
+
+    auto start = std::chrono::high_resolution_clock::now();
+    size_t peak = 0;
+    for (const auto &name : order) {
+        uint8_t value;
+        TablePosition probe;
+        probe.name = name;
+        probe.count = static_cast<int>(name.size()) - 1;
+        if (tables.probe_generated(probe, value)) {
+            out << "info string " << name << " already generated" << std::endl;
+            continue;
+        }
+
+        detail::Generator generator(name, tables, threads);
+        GenerationStats stats = generator.run();
+        std::string path = (std::filesystem::path(dir) / (name + ".nbtb")).string();
+        if (!generator.write(path)) {
+            out << "info string cannot write " << path << std::endl;
+            return false;
+        }
+        tables.init(dir);
+        peak = std::max(peak, stats.memory);
+
+        size_t legal = stats.wins + stats.draws + stats.losses;
+        out << "info string " << name << " positions " << legal << " of " << stats.positions << " wins "
+            << stats.wins << " draws " << stats.draws << " losses " << stats.losses << " longest mate "
+            << stats.longest << " plies memory " << stats.memory / (1024 * 1024) << " MB time "
+            << stats.seconds << "s" << std::endl;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+    out << "info string generated " << order.size() << " tables in " << seconds << "s, peak memory "
+        << peak / (1024 * 1024) << " MB, tables on disk " << tables.mapped_bytes() / (1024 * 1024) << " MB"
+        << std::endl;
+
+    // Probe latency over random legal positions of the requested tables
+    std::mt19937 rng(1);
+    std::vector<chess::Board> boards;
+    while (boards.size() < 10000) {
+        const std::string &name = names[rng() % names.size()];
+        std::string grid(64, '1');
+        for (size_t c = 0; c < name.size(); c++) {
+            if (name[c] == 'v') {
+                continue;
+            }
+            int sq;
+            do {
+                sq = rng() % 64;
+            } while (grid[sq] != '1' || (name[c] == 'P' && (sq < 8 || sq >= 56)));
+            grid[sq] = c < name.find('v') ? name[c] : static_cast<char>(std::tolower(name[c]));
+        }
+        std::string fen;
+        for (int rank = 7; rank >= 0; rank--) {
+            fen += grid.substr(rank * 8, 8) + (rank > 0 ? "/" : "");
+        }
+        chess::Board board(fen + (rng() % 2 ? " w" : " b") + " - - 0 1");
+        if (!board.isAttacked(board.kingSq(~board.sideToMove()), board.sideToMove())) {
+            boards.push_back(board);
+        }
+    }
+
+    const int rounds = 100;
+    size_t hits = 0;
+    auto probe_start = std::chrono::high_resolution_clock::now();
+    for (int r = 0; r < rounds; r++) {
+        for (const auto &board : boards) {
+            Wdl wdl;
+            hits += tables.probe_wdl(board, wdl);
+        }
+    }
+    double probe_ns = std::chrono::duration<double, std::nano>(std::chrono::high_resolution_clock::now() - probe_start).count();
+    out << "info string probe latency " << probe_ns / (rounds * boards.size()) << " ns over " << boards.size()
+        << " positions, " << hits * 100 / (rounds * boards.size()) << "% found" << std::endl;
+    return true;
+}
+
+}  // namespace tb